@@ -0,0 +1,112 @@
+#!/bin/sh
+# PCI enumeration scaling benchmark.
+#
+# Boots LakeBIOS on QEMU Q35 with generated topologies of growing size and collects what
+# pci_setup() reports on the debug console: enumeration time, configuration space accesses,
+# bus numbers used and how full each root window got. Every topology hangs ROOTS root ports
+# off the host bridge, each with an x3130 switch of PORTS downstream ports. Every downstream
+# port gets an endpoint, except for the last one of each switch at the top DEPTH - 1 levels,
+# which gets another switch instead.
+#
+# Usage: bench/pci-topology.sh [bios] [roots...]
+# Environment: PORTS (4), DEPTH (2), TIMEOUT in seconds (20), QEMU (qemu-system-x86_64), OUT (bench_output)
+
+BIOS=${1:-lakebios.bin}
+[ $# -gt 0 ] && shift
+SIZES=${*:-1 2 4 8 16}
+PORTS=${PORTS:-4}
+DEPTH=${DEPTH:-2}
+TIMEOUT=${TIMEOUT:-20}
+QEMU=${QEMU:-qemu-system-x86_64}
+OUT=${OUT:-bench_output}
+
+if [ ! -f "$BIOS" ]; then
+    echo "No BIOS image at $BIOS, build it with make TARGET=qemu-q35-ich9 (or qemu-hybrid) first" >&2
+    exit 1
+fi
+mkdir -p "$OUT"
+
+# Endpoints alternate between virtio and NVMe, so that both 32 and 64 bit BARs show up
+endpoint() {
+    if [ $(($2 % 2)) -eq 0 ]; then
+        echo "-device virtio-rng-pci,bus=$1"
+    else
+        echo "-drive if=none,id=drive$2,file=null-co://,format=raw -device nvme,drive=drive$2,serial=bench$2,bus=$1"
+    fi
+}
+
+# switch <parent bus> <name> <level>
+switch() {
+    echo "-device x3130-upstream,id=$2,bus=$1"
+    port=0
+    while [ $port -lt "$PORTS" ]; do
+        chassis=$((chassis + 1))
+        echo "-device xio3130-downstream,id=$2.$port,bus=$2,chassis=$chassis,slot=$port"
+        if [ $port -lt $((PORTS - 1)) ] || [ "$3" -ge "$DEPTH" ]; then
+            endpoints=$((endpoints + 1))
+            endpoint "$2.$port" $endpoints
+        fi
+        port=$((port + 1))
+    done
+    # Shell functions have no locals, so the nested switch only goes in once this one is done
+    if [ "$3" -lt "$DEPTH" ]; then
+        switch "$2.$((PORTS - 1))" "$2.s" $(($3 + 1))
+    fi
+}
+
+topology() {
+    chassis=0
+    endpoints=0
+    root=0
+    while [ $root -lt "$1" ]; do
+        chassis=$((chassis + 1))
+        # Eight root ports per slot of the host bridge, starting at slot 4
+        function=$((root % 8))
+        multifunction=off
+        [ $function -eq 0 ] && multifunction=on
+        echo "-device pcie-root-port,id=rp$root,bus=pcie.0,chassis=$chassis,slot=0,addr=$((root / 8 + 4)).$function,multifunction=$multifunction"
+        switch "rp$root" "sw$root" 1
+        root=$((root + 1))
+    done
+}
+
+# field <log> <sed expression>, on the lines print() wrote, without their prefix
+field() {
+    sed -n 's/^lakebios: //p' "$1" | sed -n "$2" | head -n 1
+}
+
+printf '%-6s %-10s %-10s %-10s %-6s %-12s %-12s %-10s %s\n' roots functions kcycles accesses buses cycles/fn accesses/fn unassigned flags
+base_cycles=
+base_accesses=
+for roots in $SIZES; do
+    log="$OUT/pci-$roots.log"
+    timeout "$TIMEOUT" "$QEMU" -M q35 -m 512 -bios "$BIOS" -display none -serial none -monitor none \
+        -debugcon file:"$log" $(topology "$roots") >/dev/null 2>&1
+    functions=$(field "$log" 's/^PCI: \([0-9]*\) functions on \([0-9]*\) buses.*/\1/p')
+    buses=$(field "$log" 's/^PCI: \([0-9]*\) functions on \([0-9]*\) buses.*/\2/p')
+    unassigned=$(field "$log" 's/.* buses, \([0-9]*\) resources unassigned.*/\1/p')
+    kcycles=$(field "$log" 's/^PCI: Enumeration took \([0-9]*\) kcycles.*/\1/p')
+    accesses=$(field "$log" 's/.* and \([0-9]*\) configuration space accesses.*/\1/p')
+    if [ -z "$functions" ] || [ -z "$kcycles" ]; then
+        printf '%-6s %s\n' "$roots" "no enumeration summary in $log"
+        continue
+    fi
+    flags=
+    # A missing count is flagged instead of taken for 0
+    [ -z "$unassigned" ] && flags="$flags no-unassigned-count"
+    [ -z "$accesses" ] && flags="$flags no-access-count"
+    unassigned=${unassigned:-0}
+    accesses=${accesses:-0}
+    cycles_per=$((kcycles * 1000 / functions))
+    accesses_per=$((accesses / functions))
+    [ -z "$base_cycles" ] && base_cycles=$cycles_per && base_accesses=$accesses_per
+    # Per function costs should stay flat as the topology grows
+    [ $((cycles_per * 2)) -gt $((base_cycles * 3)) ] && flags="$flags superlinear-time"
+    [ $((accesses_per * 2)) -gt $((base_accesses * 3)) ] && flags="$flags superlinear-accesses"
+    [ "$unassigned" -gt 0 ] && flags="$flags window-overflow"
+    grep -q "Ran out of bus numbers" "$log" && flags="$flags bus-overflow"
+    grep -q "Inventory full\|Too many resources" "$log" && flags="$flags table-overflow"
+    printf '%-6s %-10s %-10s %-10s %-6s %-12s %-12s %-10s %s\n' \
+        "$roots" "$functions" "$kcycles" "$accesses" "$buses" "$cycles_per" "$accesses_per" "$unassigned" "${flags:-ok}"
+    sed -n 's/^lakebios: PCI: \(.* window at .*\)/       \1/p' "$log"
+done
@@ -0,0 +1,17 @@
+#ifndef __CPU_MISC_H__
+#define __CPU_MISC_H__
+
+#include <stdint.h>
+
+// Host build: time means nothing against the simulated machine, so it stands still and the output
+// of a topology is the same on every run. The CPU reports APIC ID 0
+static inline uint64_t rdtsc() {
+    return 0;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    (void) leaf;
+    *eax = *ebx = *ecx = *edx = 0;
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef __CPU_MMIO_H__
+#define __CPU_MMIO_H__
+
+#include <stdint.h>
+
+// Host build: memory accesses go to the simulated ECAM window in pcisim.c
+uint8_t mmio_readb(uintptr_t address);
+uint16_t mmio_readw(uintptr_t address);
+uint32_t mmio_readd(uintptr_t address);
+void mmio_writeb(uintptr_t address, uint8_t data);
+void mmio_writew(uintptr_t address, uint16_t data);
+void mmio_writed(uintptr_t address, uint32_t data);
+
+#endif
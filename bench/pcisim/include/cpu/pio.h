@@ -0,0 +1,14 @@
+#ifndef __CPU_PIO_H__
+#define __CPU_PIO_H__
+
+#include <stdint.h>
+
+// Host build: port accesses go to the simulated machine in pcisim.c instead of the hardware
+uint8_t inb(uint16_t port);
+uint16_t inw(uint16_t port);
+uint32_t ind(uint16_t port);
+void outb(uint16_t port, uint8_t data);
+void outw(uint16_t port, uint16_t data);
+void outd(uint16_t port, uint32_t data);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef __TOOLS_ALLOC_H__
+#define __TOOLS_ALLOC_H__
+
+#include <stddef.h>
+
+// Host build: the BIOS heap API on top of the C library, renamed so it doesn't replace it
+#define malloc(size, alignment) pcisim_malloc(size, alignment)
+#define calloc(size, alignment) pcisim_calloc(size, alignment)
+#define free(base, size)        pcisim_free(base, size)
+
+void *pcisim_malloc(size_t size, size_t alignment);
+void *pcisim_calloc(size_t size, size_t alignment);
+void pcisim_free(void *base, size_t size);
+
+#endif
@@ -0,0 +1,577 @@
+// Host-side PCI configuration space simulator. Builds src/drivers/bus/pci.c (and the real print())
+// against a machine described by a topology file, runs pci_setup() on it and dumps what every
+// function ended up with: bus numbers, BARs, bridge windows, payload sizes and VF BARs. The
+// enumeration summary printed by pci.c has the configuration space access count for the topology.
+// Time stands still on the host (see include/cpu/misc.h), so the output is the same on every run
+// and make pcisim-check compares it against the .expected file next to each topology.
+//
+// Topology files have one statement per line, # starts a comment:
+//   window <io|mem|pref> <base> <limit>            Root window, more of the same kind get chained
+//   ecam <base> <buses>                             Configuration space is also reachable through ECAM
+//   bridge <name> <parent|root> <slot>.<function> [noio] [nopref] [pref32]
+//   device <name> <parent|root> <slot>.<function> [vendor:device] [class]
+//   bar <n> <io|mem32|mem64|pref32|pref64> <size>  For the last device, 64 bit ones take two slots
+//   rom <size>                                      Expansion ROM of the last device
+//   pcie <root|down|up|endpoint> [max payload]      PCI Express capability of the last function
+//   hotplug                                         The last port is hotplug capable
+//   rebar <n> <max size>                            BAR n of the last device can be resized from 1 MB up
+//   sriov <total VFs>                               SR-IOV capability of the last device
+//   vfbar <n> <type> <size>                         VF BAR n, with the same types as bar
+//
+// Extended capabilities are only seen by the enumeration through ECAM. Ports get their slot and
+// link status from whether anything sits behind them.
+//
+// Build and run with: make pcisim TOPOLOGY=bench/pcisim/topologies/q35-switch.topo
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cpu/mmio.h>
+#include <drivers/bus/pci.h>
+
+#define MAX_FUNCTIONS 512
+#define MAX_WINDOWS   8
+
+#define SIM_PCIE_CAP 0x40 // Only capability in the standard list
+
+struct sim_function {
+    char name[32];
+    struct sim_function *parent; // NULL on the root bus
+    int slot;
+    int function;
+    int bridge;
+    uint8_t cfg[PCI_CFG_SPACE_EXT_SIZE];
+    uint8_t wmask[PCI_CFG_SPACE_EXT_SIZE]; // Bits that writes can change
+    uint64_t bar_sizes[6];
+    uint64_t vf_bar_sizes[6];
+    int pcie; // Offset of each capability, 0 when there is none
+    int rebar;
+    int sriov;
+    int ext_last; // Last extended capability, the next one gets chained to it
+};
+
+static struct sim_function functions[MAX_FUNCTIONS];
+static int function_count;
+static uint32_t address;
+static uint32_t address_writes;
+static uint64_t ecam_base;
+static int ecam_buses;
+
+static struct pci_bar_window windows[3][MAX_WINDOWS];
+static int window_count[3];
+
+/* Heap of the BIOS, on top of the C library */
+
+void *pcisim_malloc(size_t size, size_t alignment) {
+    void *ptr = NULL;
+    return posix_memalign(&ptr, alignment < sizeof(void *) ? sizeof(void *) : alignment, size) ? NULL : ptr;
+}
+
+void *pcisim_calloc(size_t size, size_t alignment) {
+    void *ptr = pcisim_malloc(size, alignment);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+void pcisim_free(void *base, size_t size) {
+    (void) size;
+    free(base);
+}
+
+/* Configuration space */
+
+static void set16(uint8_t *space, int offset, uint16_t value) {
+    space[offset] = value;
+    space[offset + 1] = value >> 8;
+}
+
+static void set32(uint8_t *space, int offset, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        space[offset + i] = value >> (i * 8);
+    }
+}
+
+static uint16_t get16(const uint8_t *space, int offset) {
+    return space[offset] | (space[offset + 1] << 8);
+}
+
+static uint32_t get32(const uint8_t *space, int offset) {
+    return space[offset] | (space[offset + 1] << 8) | (space[offset + 2] << 16) | ((uint32_t) space[offset + 3] << 24);
+}
+
+static int bus_of(const struct sim_function *f) {
+    return f->parent ? f->parent->cfg[PCI_CFG_SECONDARY_BUS] : 0;
+}
+
+// Bridges pass on accesses to the buses between their secondary and subordinate ones
+static int forwards(const struct sim_function *bridge, int bus) {
+    for (; bridge; bridge = bridge->parent) {
+        uint8_t secondary = bridge->cfg[PCI_CFG_SECONDARY_BUS];
+        if (!secondary || bus == bus_of(bridge) || bus < secondary || bus > bridge->cfg[PCI_CFG_SUBORDINATE_BUS]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static struct sim_function *route(int bus, int slot, int function) {
+    for (int i = 0; i < function_count; i++) {
+        struct sim_function *f = &functions[i];
+        if (f->slot == slot && f->function == function && bus_of(f) == bus && (!f->parent || forwards(f->parent, bus))) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// Sets what a BAR (or VF BAR) at offset decodes, the low bits of a BAR are its type
+static void bar_set(struct sim_function *f, int offset, const char *type, uint64_t size) {
+    uint64_t mask = ~(size - 1);
+    if (!strcmp(type, "io")) {
+        set32(f->cfg, offset, PCI_BAR_IO);
+        set32(f->wmask, offset, mask & 0xfffc);
+        return;
+    }
+    int is64 = !strcmp(type, "mem64") || !strcmp(type, "pref64");
+    int pref = !strcmp(type, "pref32") || !strcmp(type, "pref64");
+    set32(f->cfg, offset, (is64 ? PCI_BAR_MEM_64 << 1 : 0) | (pref ? PCI_BAR_PREF_32 << 1 : 0));
+    set32(f->wmask, offset, mask & 0xfffffff0);
+    if (is64) {
+        set32(f->wmask, offset + 4, mask >> 32);
+    }
+}
+
+static const char *bar_type(uint32_t bar) {
+    int is64 = !(bar & PCI_BAR_IO) && ((bar >> 1) & 0x03) == 2;
+    return bar & PCI_BAR_IO ? "io" : (bar & (PCI_BAR_PREF_32 << 1)) ? (is64 ? "pref64" : "pref32") : (is64 ? "mem64" : "mem32");
+}
+
+// A new size in the Resizable BAR control register changes what the BAR decodes right away
+static void rebar_update(struct sim_function *f) {
+    uint32_t control = get32(f->cfg, f->rebar + PCI_REBAR_CONTROL);
+    int bar = control & 0x07;
+    uint64_t size = (uint64_t) 0x100000 << ((control >> 8) & 0x3f);
+    if (size != f->bar_sizes[bar]) {
+        uint32_t value = get32(f->cfg, PCI_CFG_BAR0 + (bar * 4));
+        f->bar_sizes[bar] = size;
+        bar_set(f, PCI_CFG_BAR0 + (bar * 4), bar_type(value), size);
+    }
+}
+
+static uint32_t space_read(const struct sim_function *f, int offset, int size) {
+    uint32_t value = 0;
+    for (int i = 0; i < size; i++) {
+        value |= (uint32_t) (f ? f->cfg[offset + i] : 0xff) << (i * 8);
+    }
+    return value;
+}
+
+static void space_write(struct sim_function *f, int offset, int size, uint32_t value) {
+    for (int i = 0; f && i < size; i++) {
+        uint8_t byte = value >> (i * 8);
+        f->cfg[offset + i] = (f->cfg[offset + i] & ~f->wmask[offset + i]) | (byte & f->wmask[offset + i]);
+    }
+    if (f && f->rebar && offset < f->rebar + PCI_REBAR_CONTROL + 4 && offset + size > f->rebar + PCI_REBAR_CONTROL) {
+        rebar_update(f);
+    }
+}
+
+static struct sim_function *port_route() {
+    if (!(address & 0x80000000)) {
+        return NULL;
+    }
+    return route((address >> 16) & 0xff, (address >> 11) & 0x1f, (address >> 8) & 0x07);
+}
+
+uint8_t inb(uint16_t port) {
+    return port >= PCI_CFG_DATA && port < PCI_CFG_DATA + 4 ? space_read(port_route(), (address & 0xfc) + (port - PCI_CFG_DATA), 1) : 0xff;
+}
+
+uint16_t inw(uint16_t port) {
+    return port >= PCI_CFG_DATA && port < PCI_CFG_DATA + 4 ? space_read(port_route(), (address & 0xfc) + (port - PCI_CFG_DATA), 2) : 0xffff;
+}
+
+uint32_t ind(uint16_t port) {
+    if (port == PCI_CFG_ADDRESS) {
+        return address;
+    }
+    return port == PCI_CFG_DATA ? space_read(port_route(), address & 0xfc, 4) : 0xffffffff;
+}
+
+void outb(uint16_t port, uint8_t data) {
+    if (port == 0xe9) {
+        putchar(data);
+    } else if (port >= PCI_CFG_DATA && port < PCI_CFG_DATA + 4) {
+        space_write(port_route(), (address & 0xfc) + (port - PCI_CFG_DATA), 1, data);
+    }
+}
+
+void outw(uint16_t port, uint16_t data) {
+    if (port >= PCI_CFG_DATA && port < PCI_CFG_DATA + 4) {
+        space_write(port_route(), (address & 0xfc) + (port - PCI_CFG_DATA), 2, data);
+    }
+}
+
+void outd(uint16_t port, uint32_t data) {
+    if (port == PCI_CFG_ADDRESS) {
+        address = data;
+        address_writes++;
+    } else if (port == PCI_CFG_DATA) {
+        space_write(port_route(), address & 0xfc, 4, data);
+    }
+}
+
+// Nothing but configuration space is mapped, anything outside of ECAM is fatal
+static struct sim_function *ecam_route(uintptr_t address, int *offset) {
+    if (!ecam_base || address < ecam_base || address >= ecam_base + ((uint64_t) ecam_buses << 20)) {
+        fprintf(stderr, "pcisim: memory access at %#llx outside of ECAM\n", (unsigned long long) address);
+        exit(1);
+    }
+    uintptr_t relative = address - ecam_base;
+    *offset = relative & 0xfff;
+    return route((relative >> 20) & 0xff, (relative >> 15) & 0x1f, (relative >> 12) & 0x07);
+}
+
+uint8_t mmio_readb(uintptr_t address) {
+    int offset;
+    struct sim_function *f = ecam_route(address, &offset);
+    return space_read(f, offset, 1);
+}
+
+uint16_t mmio_readw(uintptr_t address) {
+    int offset;
+    struct sim_function *f = ecam_route(address, &offset);
+    return space_read(f, offset, 2);
+}
+
+uint32_t mmio_readd(uintptr_t address) {
+    int offset;
+    struct sim_function *f = ecam_route(address, &offset);
+    return space_read(f, offset, 4);
+}
+
+void mmio_writeb(uintptr_t address, uint8_t data) {
+    int offset;
+    struct sim_function *f = ecam_route(address, &offset);
+    space_write(f, offset, 1, data);
+}
+
+void mmio_writew(uintptr_t address, uint16_t data) {
+    int offset;
+    struct sim_function *f = ecam_route(address, &offset);
+    space_write(f, offset, 2, data);
+}
+
+void mmio_writed(uintptr_t address, uint32_t data) {
+    int offset;
+    struct sim_function *f = ecam_route(address, &offset);
+    space_write(f, offset, 4, data);
+}
+
+/* Topology files */
+
+static void init_function(struct sim_function *f, int bridge, uint32_t id, uint32_t class) {
+    set32(f->cfg, PCI_CFG_VENDOR, id);
+    set32(f->cfg, PCI_CFG_CLASS - 3, class << 8);
+    f->cfg[PCI_CFG_HEADER] = bridge ? 0x01 : 0x00;
+    f->wmask[PCI_CFG_COMMAND] = 0xff;
+    f->wmask[PCI_CFG_COMMAND + 1] = 0x07;
+    f->wmask[PCI_CFG_INTERRUPT_LINE] = 0xff;
+    if (!bridge) {
+        f->cfg[PCI_CFG_INTERRUPT_PIN] = 0x01;
+        return;
+    }
+    f->wmask[PCI_CFG_PRIMARY_BUS] = 0xff;
+    f->wmask[PCI_CFG_SECONDARY_BUS] = 0xff;
+    f->wmask[PCI_CFG_SUBORDINATE_BUS] = 0xff;
+    f->cfg[PCI_CFG_IO_BASE] = f->cfg[PCI_CFG_IO_LIMIT] = 0x01;
+    f->wmask[PCI_CFG_IO_BASE] = f->wmask[PCI_CFG_IO_LIMIT] = 0xf0;
+    set32(f->wmask, PCI_CFG_IO_BASE_HI, 0xffffffff);
+    set32(f->wmask, PCI_CFG_MEMORY_BASE, 0xfff0fff0);
+    f->cfg[PCI_CFG_PREFETCH_BASE] = f->cfg[PCI_CFG_PREFETCH_LIMIT] = PCI_PREFETCH_64;
+    set32(f->wmask, PCI_CFG_PREFETCH_BASE, 0xfff0fff0);
+    set32(f->wmask, PCI_CFG_PREFETCH_BASE_HI, 0xffffffff);
+    set32(f->wmask, PCI_CFG_PREFETCH_LIMIT_HI, 0xffffffff);
+}
+
+// Device control powers on with 128 byte payloads, 512 byte read requests and relaxed ordering
+static void add_pcie(struct sim_function *f, const char *type, int max_payload) {
+    int types[4][2] = {{'r', PCI_PCIE_TYPE_ROOT_PORT}, {'d', PCI_PCIE_TYPE_DOWNSTREAM}, {'u', 0x05}, {'e', 0x00}};
+    int code = 0;
+    for (int i = 0; i < 4; i++) {
+        if (type[0] == types[i][0]) {
+            code = types[i][1];
+        }
+    }
+    int port = code == PCI_PCIE_TYPE_ROOT_PORT || code == PCI_PCIE_TYPE_DOWNSTREAM;
+    f->pcie = SIM_PCIE_CAP;
+    set16(f->cfg, PCI_CFG_STATUS, get16(f->cfg, PCI_CFG_STATUS) | PCI_CFG_STATUS_CAPABILITIES);
+    f->cfg[PCI_CFG_CAPABILITIES] = SIM_PCIE_CAP;
+    f->cfg[SIM_PCIE_CAP] = PCI_CAP_PCIE;
+    set16(f->cfg, SIM_PCIE_CAP + PCI_PCIE_CAPS, 0x02 | (code << 4) | (port ? PCI_PCIE_CAPS_SLOT : 0));
+    int supported = 0;
+    while ((256 << supported) <= max_payload && supported < 5) {
+        supported++;
+    }
+    set32(f->cfg, SIM_PCIE_CAP + PCI_PCIE_DEVICE_CAP, supported);
+    set16(f->cfg, SIM_PCIE_CAP + PCI_PCIE_DEVICE_CONTROL, (2 << PCI_PCIE_MRRS_SHIFT) | PCI_PCIE_DEVICE_CONTROL_RELAXED);
+    set16(f->wmask, SIM_PCIE_CAP + PCI_PCIE_DEVICE_CONTROL, (0x07 << PCI_PCIE_MRRS_SHIFT) | (0x07 << PCI_PCIE_MPS_SHIFT) | PCI_PCIE_DEVICE_CONTROL_RELAXED);
+    if (port) {
+        set32(f->cfg, SIM_PCIE_CAP + PCI_PCIE_LINK_CAP, PCI_PCIE_LINK_CAP_DLL_REPORT);
+    }
+}
+
+static int add_ext_cap(struct sim_function *f, uint16_t id, int size) {
+    int offset = f->ext_last ? f->ext_last + 0x40 : PCI_EXT_CAP_START;
+    if (offset + size > PCI_CFG_SPACE_EXT_SIZE) {
+        return 0;
+    }
+    set32(f->cfg, offset, id | (1 << 16));
+    if (f->ext_last) {
+        set32(f->cfg, f->ext_last, get32(f->cfg, f->ext_last) | ((uint32_t) offset << 20));
+    }
+    f->ext_last = offset;
+    return offset;
+}
+
+// Supported sizes go from 1 MB up to max_size, the BAR starts with the size it was declared with
+static void add_rebar(struct sim_function *f, int bar, uint64_t max_size) {
+    f->rebar = add_ext_cap(f, PCI_EXT_CAP_REBAR, 0x0c);
+    uint32_t sizes = 0;
+    int current = 0;
+    for (int n = 0; n < 28 && ((uint64_t) 0x100000 << n) <= max_size; n++) {
+        sizes |= 1 << n;
+    }
+    while (((uint64_t) 0x100000 << current) < f->bar_sizes[bar]) {
+        current++;
+    }
+    set32(f->cfg, f->rebar + PCI_REBAR_CAPABILITY, sizes << 4);
+    set32(f->cfg, f->rebar + PCI_REBAR_CONTROL, bar | (1 << 5) | (current << 8));
+    set32(f->wmask, f->rebar + PCI_REBAR_CONTROL, 0x3f00);
+}
+
+static void add_sriov(struct sim_function *f, int total) {
+    f->sriov = add_ext_cap(f, PCI_EXT_CAP_SRIOV, 0x40);
+    set16(f->wmask, f->sriov + PCI_SRIOV_CONTROL, 0x1f);
+    set16(f->cfg, f->sriov + PCI_SRIOV_TOTAL_VFS, total);
+    set16(f->wmask, f->sriov + PCI_SRIOV_NUM_VFS, 0xffff);
+}
+
+static struct sim_function *find_function(const char *name) {
+    for (int i = 0; i < function_count; i++) {
+        if (!strcmp(functions[i].name, name)) {
+            return &functions[i];
+        }
+    }
+    return NULL;
+}
+
+static int load(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    char line[256];
+    int number = 0;
+    struct sim_function *last = NULL;
+    while (fgets(line, sizeof(line), file)) {
+        number++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char words[8][64] = {{0}};
+        int count = sscanf(line, "%63s %63s %63s %63s %63s %63s %63s %63s",
+            words[0], words[1], words[2], words[3], words[4], words[5], words[6], words[7]);
+        if (count <= 0) {
+            continue;
+        }
+        int kind = !strcmp(words[0], "bridge") ? 1 : !strcmp(words[0], "device") ? 0 : -1;
+        if (kind >= 0 && count >= 4 && function_count < MAX_FUNCTIONS) {
+            struct sim_function *f = &functions[function_count++];
+            snprintf(f->name, sizeof(f->name), "%s", words[1]);
+            f->parent = strcmp(words[2], "root") ? find_function(words[2]) : NULL;
+            if (strcmp(words[2], "root") && (!f->parent || !f->parent->bridge)) {
+                fprintf(stderr, "%s:%d: %s is not a bridge\n", path, number, words[2]);
+                fclose(file);
+                return -1;
+            }
+            sscanf(words[3], "%d.%d", &f->slot, &f->function);
+            f->bridge = kind;
+            unsigned int vendor = 0x1b36, device = kind ? 0x000c : 0x0001, class = kind ? 0x060400 : 0xff0000;
+            for (int i = 4; i < count; i++) {
+                if (strchr(words[i], ':')) {
+                    sscanf(words[i], "%x:%x", &vendor, &device);
+                } else if (words[i][0] >= '0' && words[i][0] <= '9') {
+                    sscanf(words[i], "%x", &class);
+                }
+            }
+            init_function(f, kind, (device << 16) | vendor, class);
+            // Bridges forward everything unless told otherwise
+            for (int i = 4; kind && i < count; i++) {
+                if (!strcmp(words[i], "noio")) {
+                    f->cfg[PCI_CFG_IO_BASE] = f->cfg[PCI_CFG_IO_LIMIT] = 0;
+                    f->wmask[PCI_CFG_IO_BASE] = f->wmask[PCI_CFG_IO_LIMIT] = 0;
+                    set32(f->wmask, PCI_CFG_IO_BASE_HI, 0);
+                } else if (!strcmp(words[i], "nopref")) {
+                    set32(f->cfg, PCI_CFG_PREFETCH_BASE, 0);
+                    set32(f->wmask, PCI_CFG_PREFETCH_BASE, 0);
+                }
+                if (!strcmp(words[i], "nopref") || !strcmp(words[i], "pref32")) {
+                    f->cfg[PCI_CFG_PREFETCH_BASE] &= 0xf0;
+                    f->cfg[PCI_CFG_PREFETCH_LIMIT] &= 0xf0;
+                    set32(f->wmask, PCI_CFG_PREFETCH_BASE_HI, 0);
+                    set32(f->wmask, PCI_CFG_PREFETCH_LIMIT_HI, 0);
+                }
+            }
+            last = f;
+        } else if (!strcmp(words[0], "bar") && count == 4 && last && !last->bridge) {
+            int bar = atoi(words[1]);
+            last->bar_sizes[bar] = strtoull(words[3], NULL, 0);
+            bar_set(last, PCI_CFG_BAR0 + (bar * 4), words[2], last->bar_sizes[bar]);
+        } else if (!strcmp(words[0], "rom") && count == 2 && last && !last->bridge) {
+            set32(last->wmask, PCI_CFG_EXPANSION_ROM, (~(strtoull(words[1], NULL, 0) - 1) & PCI_ROM_ADDRESS_MASK) | PCI_ROM_ENABLE);
+        } else if (!strcmp(words[0], "pcie") && count >= 2 && last && !last->pcie) {
+            add_pcie(last, words[1], count > 2 ? atoi(words[2]) : 256);
+        } else if (!strcmp(words[0], "hotplug") && count == 1 && last && last->pcie) {
+            set32(last->cfg, last->pcie + PCI_PCIE_SLOT_CAP, PCI_PCIE_SLOT_CAP_HOTPLUG);
+        } else if (!strcmp(words[0], "rebar") && count == 3 && last && !last->rebar && last->bar_sizes[atoi(words[1]) & 0x07]) {
+            add_rebar(last, atoi(words[1]) & 0x07, strtoull(words[2], NULL, 0));
+        } else if (!strcmp(words[0], "sriov") && count == 2 && last && !last->bridge && !last->sriov) {
+            add_sriov(last, atoi(words[1]));
+        } else if (!strcmp(words[0], "vfbar") && count == 4 && last && last->sriov) {
+            int bar = atoi(words[1]);
+            last->vf_bar_sizes[bar] = strtoull(words[3], NULL, 0);
+            bar_set(last, last->sriov + PCI_SRIOV_BAR0 + (bar * 4), words[2], last->vf_bar_sizes[bar]);
+        } else if (!strcmp(words[0], "ecam") && count == 3) {
+            ecam_base = strtoull(words[1], NULL, 0);
+            ecam_buses = atoi(words[2]);
+        } else if (!strcmp(words[0], "window") && count == 4) {
+            int kind = !strcmp(words[1], "io") ? 0 : !strcmp(words[1], "mem") ? 1 : 2;
+            if (window_count[kind] < MAX_WINDOWS) {
+                struct pci_bar_window *window = &windows[kind][window_count[kind]];
+                window->orig_base = window->base = strtoull(words[2], NULL, 0);
+                window->limit = strtoull(words[3], NULL, 0);
+                if (window_count[kind]) {
+                    windows[kind][window_count[kind] - 1].next = window;
+                }
+                window_count[kind]++;
+            }
+        } else {
+            fprintf(stderr, "%s:%d: cannot parse \"%s\"\n", path, number, words[0]);
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    for (int i = 0; i < function_count; i++) {
+        for (int j = 0; j < function_count; j++) {
+            // Function 0 tells whether the slot has more
+            if (functions[j].function && !functions[i].function && functions[j].parent == functions[i].parent && functions[j].slot == functions[i].slot) {
+                functions[i].cfg[PCI_CFG_HEADER] |= PCI_CFG_HEADER_MULTIFUNCTION;
+            }
+            // A port with something behind it has a card present and its link up
+            struct sim_function *port = &functions[i];
+            if (functions[j].parent == port && (get16(port->cfg, port->pcie + PCI_PCIE_CAPS) & PCI_PCIE_CAPS_SLOT)) {
+                set16(port->cfg, port->pcie + PCI_PCIE_SLOT_STATUS, PCI_PCIE_SLOT_STATUS_PRESENCE);
+                set16(port->cfg, port->pcie + PCI_PCIE_LINK_STATUS, PCI_PCIE_LINK_STATUS_DLL);
+            }
+        }
+    }
+    // The windows of a Q35 guest with 2 GB of RAM, unless the file has its own
+    uint64_t defaults[3][2] = {{0x1000, 0xffff}, {0x80000000, 0xc0000000}, {0xc0000000, 0xfec00000}};
+    for (int i = 0; i < 3; i++) {
+        if (!window_count[i]) {
+            windows[i][0].orig_base = windows[i][0].base = defaults[i][0];
+            windows[i][0].limit = defaults[i][1];
+            window_count[i] = 1;
+        }
+    }
+    return 0;
+}
+
+/* Results */
+
+static uint8_t interrupt_line(int pin, uint8_t bus, uint8_t slot, uint8_t function) {
+    (void) bus;
+    (void) function;
+    return pin ? 10 + ((slot + pin) & 3) : 0xff;
+}
+
+static void dump_bar(const struct sim_function *f, int offset, const char *label, int n, uint64_t size) {
+    uint32_t bar = get32(f->cfg, offset);
+    uint64_t base = bar & (bar & PCI_BAR_IO ? ~0x03 : ~0x0f);
+    const char *type = bar_type(bar);
+    if (!strcmp(type, "mem64") || !strcmp(type, "pref64")) {
+        base |= (uint64_t) get32(f->cfg, offset + 4) << 32;
+    }
+    printf("    %s %d %-6s %#llx size %#llx\n", label, n, type, (unsigned long long) base, (unsigned long long) size);
+}
+
+static void dump(const struct sim_function *f) {
+    printf("%-16s bus %3d slot %2d function %d  command %04x", f->name, bus_of(f), f->slot, f->function, get32(f->cfg, PCI_CFG_COMMAND) & 0xffff);
+    if (f->bridge) {
+        printf("  buses %d-%d", f->cfg[PCI_CFG_SECONDARY_BUS], f->cfg[PCI_CFG_SUBORDINATE_BUS]);
+    }
+    printf("\n");
+    if (f->pcie) {
+        uint16_t control = get16(f->cfg, f->pcie + PCI_PCIE_DEVICE_CONTROL);
+        printf("    pcie payload %d read request %d%s\n", 128 << ((control >> PCI_PCIE_MPS_SHIFT) & 0x07),
+            128 << ((control >> PCI_PCIE_MRRS_SHIFT) & 0x07), control & PCI_PCIE_DEVICE_CONTROL_RELAXED ? " relaxed" : "");
+    }
+    if (f->bridge) {
+        uint64_t io_base = ((uint64_t) (f->cfg[PCI_CFG_IO_BASE] & 0xf0) << 8) | ((uint64_t) (get32(f->cfg, PCI_CFG_IO_BASE_HI) & 0xffff) << 16);
+        uint64_t io_limit = ((uint64_t) (f->cfg[PCI_CFG_IO_LIMIT] & 0xf0) << 8) | 0xfff | ((uint64_t) (get32(f->cfg, PCI_CFG_IO_BASE_HI) >> 16) << 16);
+        uint64_t mem_base = (uint64_t) (get32(f->cfg, PCI_CFG_MEMORY_BASE) & 0xfff0) << 16;
+        uint64_t mem_limit = ((uint64_t) (get32(f->cfg, PCI_CFG_MEMORY_BASE) >> 16 & 0xfff0) << 16) | 0xfffff;
+        uint64_t pref_base = ((uint64_t) (get32(f->cfg, PCI_CFG_PREFETCH_BASE) & 0xfff0) << 16) | ((uint64_t) get32(f->cfg, PCI_CFG_PREFETCH_BASE_HI) << 32);
+        uint64_t pref_limit = ((uint64_t) (get32(f->cfg, PCI_CFG_PREFETCH_BASE) >> 16 & 0xfff0) << 16) | 0xfffff | ((uint64_t) get32(f->cfg, PCI_CFG_PREFETCH_LIMIT_HI) << 32);
+        const char *names[3] = {"io", "mem", "pref"};
+        uint64_t ranges[3][2] = {{io_base, io_limit}, {mem_base, mem_limit}, {pref_base, pref_limit}};
+        for (int i = 0; i < 3; i++) {
+            if (ranges[i][0] <= ranges[i][1]) {
+                printf("    window %-4s %#llx-%#llx\n", names[i], (unsigned long long) ranges[i][0], (unsigned long long) ranges[i][1]);
+            } else {
+                printf("    window %-4s closed\n", names[i]);
+            }
+        }
+        return;
+    }
+    for (int i = 0; i < 6; i++) {
+        if (f->bar_sizes[i]) {
+            dump_bar(f, PCI_CFG_BAR0 + (i * 4), "bar", i, f->bar_sizes[i]);
+        }
+    }
+    if (get32(f->wmask, PCI_CFG_EXPANSION_ROM)) {
+        printf("    rom      %#x\n", get32(f->cfg, PCI_CFG_EXPANSION_ROM) & PCI_ROM_ADDRESS_MASK);
+    }
+    for (int i = 0; f->sriov && i < 6; i++) {
+        if (f->vf_bar_sizes[i]) {
+            dump_bar(f, f->sriov + PCI_SRIOV_BAR0 + (i * 4), "vfbar", i, f->vf_bar_sizes[i]);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <topology file>\n", argv[0]);
+        return 1;
+    }
+    if (load(argv[1]) != 0) {
+        return 1;
+    }
+    if (ecam_base && pci_ecam_enable(ecam_base, ecam_buses) != 0) {
+        return 1;
+    }
+    int result = pci_setup(&windows[1][0], &windows[0][0], &windows[2][0], interrupt_line);
+    printf("\n%d functions, %u configuration addresses written\n", function_count, address_writes);
+    for (int i = 0; i < function_count; i++) {
+        dump(&functions[i]);
+    }
+    return result ? 1 : 0;
+}
@@ -0,0 +1,39 @@
+#include <apis/bios32.h>
+#include <stddef.h>
+
+__attribute__((__aligned__(16), __used__))
+static struct bios32_header bios32_header = {
+    .signature = {'_', '3', '2', '_'},
+    .revision = 0x00,
+    .length = sizeof(struct bios32_header) / 16,
+};
+
+// EBX has to be 0 on entry, it selects the function of the directory and there is only this one.
+// Every service is given the whole BIOS, data included, so the caller maps everything it needs
+__asm__(
+    ".pushsection .text\n"
+    "bios32_entry:\n"
+    "    cmpl $0x49435024, %eax\n" // BIOS32_SERVICE_PCI
+    "    jne 1f\n"
+    "    movl $0xe0000, %ebx\n"
+    "    movl $0x20000, %ecx\n"
+    "    movl $(pci_bios_entry - 0xe0000), %edx\n"
+    "    movb $0x00, %al\n"
+    "    lret\n"
+    "1:\n"
+    "    movb $0x80, %al\n"
+    "    lret\n"
+    ".popsection\n"
+);
+
+extern char bios32_entry[];
+
+void bios32_init() {
+    bios32_header.entry = (uintptr_t) bios32_entry;
+    uint8_t sum = 0;
+    bios32_header.checksum = 0;
+    for (size_t i = 0; i < sizeof(struct bios32_header); i++) {
+        sum += *((uint8_t *) &bios32_header + i);
+    }
+    bios32_header.checksum = -sum;
+}
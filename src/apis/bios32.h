@@ -0,0 +1,25 @@
+#ifndef __APIS_BIOS32_H__
+#define __APIS_BIOS32_H__
+
+#include <stdint.h>
+
+// BIOS32 Service Directory. Protected mode callers find the header by scanning 0xe0000-0xfffff on
+// paragraph boundaries, then far call its entry with the identifier of a service in EAX, and get
+// back where the service lives: base in EBX, length in ECX, entry offset from the base in EDX
+#define BIOS32_SERVICE_PCI 0x49435024 // "$PCI"
+
+#define BIOS32_SUCCESSFUL    0x00
+#define BIOS32_NOT_PRESENT   0x80
+
+struct bios32_header {
+    char signature[4];
+    uint32_t entry;
+    uint8_t revision;
+    uint8_t length; // In 16 byte units
+    uint8_t checksum;
+    uint8_t reserved[5];
+} __attribute__((__packed__));
+
+void bios32_init();
+
+#endif
@@ -0,0 +1,125 @@
+#include <apis/pci_bios.h>
+#include <cpu/pio.h>
+#include <drivers/bus/pci.h>
+
+// The caller can map the BIOS anywhere, so this runs delta bytes away from where it was linked.
+// Everything reached through an absolute address has to be moved by delta, and nothing else of
+// the BIOS can be called. Configuration space goes through the ports, ECAM may not be mapped
+struct pci_bios_regs {
+    uint32_t edi;
+    uint32_t esi;
+    uint32_t ebp;
+    uint32_t esp;
+    uint32_t ebx;
+    uint32_t edx;
+    uint32_t ecx;
+    uint32_t eax;
+};
+
+static struct pci_inventory pci_bios_inventory;
+
+int pci_bios_call(struct pci_bios_regs *regs, uintptr_t delta);
+
+// The carry flag is set when pci_bios_call() returns 0
+__asm__(
+    ".pushsection .text\n"
+    ".globl pci_bios_entry\n"
+    "pci_bios_entry:\n"
+    "    pushal\n"
+    "    cld\n"
+    "    call 1f\n"
+    "1:\n"
+    "    popl %eax\n"
+    "    subl $1b, %eax\n"
+    "    movl %esp, %ecx\n"
+    "    pushl %eax\n"
+    "    pushl %ecx\n"
+    "    call pci_bios_call\n"
+    "    addl $8, %esp\n"
+    "    cmpl $1, %eax\n"
+    "    popal\n"
+    "    lret\n"
+    ".popsection\n"
+);
+
+// Finds the index-th function with that ID in a class or vendor chain
+static int find(const struct pci_inventory *inventory, int count, uint16_t first, const uint16_t *next, uint32_t id, int by_class, int index) {
+    for (int i = first; i < count; i = next[i]) {
+        const struct pci_function *entry = &inventory->functions[i];
+        uint32_t entry_id = by_class ? ((uint32_t) entry->class << 16) | (entry->subclass << 8) | entry->interface
+            : ((uint32_t) entry->device << 16) | entry->vendor;
+        if (entry_id == id && index-- == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int pci_bios_call(struct pci_bios_regs *regs, uintptr_t delta) {
+    struct pci_inventory inventory = *(struct pci_inventory *) ((uintptr_t) &pci_bios_inventory + delta);
+    inventory.functions = (struct pci_function *) ((uintptr_t) inventory.functions + delta);
+    int count = *(int *) ((uintptr_t) inventory.count + delta);
+    uint8_t function = regs->eax & 0xff;
+    uint8_t status = PCI_BIOS_SUCCESSFUL;
+    if ((regs->eax >> 8 & 0xff) != PCI_BIOS_FUNCTION_ID) {
+        status = PCI_BIOS_FUNC_NOT_SUPPORTED;
+    } else if (function == PCI_BIOS_PRESENT) {
+        int last_bus = *(int *) ((uintptr_t) inventory.last_bus + delta);
+        regs->edx = 0x20494350; // "PCI "
+        regs->eax = (regs->eax & ~0xffff) | 0x01; // Configuration mechanism #1
+        regs->ebx = (regs->ebx & ~0xffff) | 0x0210;
+        regs->ecx = (regs->ecx & ~0xff) | last_bus;
+        return 1;
+    } else if (function == PCI_BIOS_FIND_DEVICE || function == PCI_BIOS_FIND_CLASS) {
+        int by_class = function == PCI_BIOS_FIND_CLASS;
+        uint32_t id = by_class ? regs->ecx & 0xffffff : ((regs->ecx & 0xffff) << 16) | (regs->edx & 0xffff);
+        int i;
+        if (by_class) {
+            const uint16_t *head = (const uint16_t *) ((uintptr_t) inventory.class_head + delta);
+            i = find(&inventory, count, head[PCI_CLASS_BUCKET(id >> 16)], (const uint16_t *) ((uintptr_t) inventory.class_next + delta), id, 1, regs->esi & 0xffff);
+        } else {
+            const uint16_t *head = (const uint16_t *) ((uintptr_t) inventory.vendor_head + delta);
+            i = find(&inventory, count, head[PCI_VENDOR_BUCKET(id & 0xffff)], (const uint16_t *) ((uintptr_t) inventory.vendor_next + delta), id, 0, regs->esi & 0xffff);
+        }
+        if (!by_class && (id & 0xffff) == 0xffff) {
+            status = PCI_BIOS_BAD_VENDOR_ID;
+        } else if (i < 0) {
+            status = PCI_BIOS_DEVICE_NOT_FOUND;
+        } else {
+            const struct pci_function *entry = &inventory.functions[i];
+            regs->ebx = (regs->ebx & ~0xffff) | (entry->bus << 8) | (entry->slot << 3) | entry->function;
+        }
+    } else if (function >= PCI_BIOS_READ_BYTE && function <= PCI_BIOS_WRITE_DWORD) {
+        // BH is the bus and BL the device and function, right where the address wants them
+        uint16_t offset = regs->edi & 0xffff;
+        int size = 1 << ((function - PCI_BIOS_READ_BYTE) % 3);
+        if (offset >= PCI_CFG_SPACE_SIZE || offset & (size - 1)) {
+            status = PCI_BIOS_BAD_REGISTER_NUMBER;
+        } else {
+            outd(PCI_CFG_ADDRESS, 0x80000000 | ((regs->ebx & 0xffff) << 8) | (offset & 0xfc));
+            uint16_t port = PCI_CFG_DATA + (offset & 3);
+            if (function == PCI_BIOS_READ_BYTE) {
+                regs->ecx = (regs->ecx & ~0xff) | inb(port);
+            } else if (function == PCI_BIOS_READ_WORD) {
+                regs->ecx = (regs->ecx & ~0xffff) | inw(port);
+            } else if (function == PCI_BIOS_READ_DWORD) {
+                regs->ecx = ind(port);
+            } else if (function == PCI_BIOS_WRITE_BYTE) {
+                outb(port, regs->ecx);
+            } else if (function == PCI_BIOS_WRITE_WORD) {
+                outw(port, regs->ecx);
+            } else {
+                outd(port, regs->ecx);
+            }
+        }
+    } else {
+        status = PCI_BIOS_FUNC_NOT_SUPPORTED;
+    }
+    regs->eax = (regs->eax & ~0xff00) | (status << 8);
+    return status == PCI_BIOS_SUCCESSFUL;
+}
+
+// Called after enumeration. The inventory is read on every call, so rescans are picked up
+void pci_bios_init() {
+    pci_inventory_get(&pci_bios_inventory);
+}
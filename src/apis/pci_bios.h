@@ -0,0 +1,26 @@
+#ifndef __APIS_PCI_BIOS_H__
+#define __APIS_PCI_BIOS_H__
+
+// PCI BIOS 2.10 protected mode interface, reached through the BIOS32 directory. AH is 0xb1 and AL
+// the function on entry, AH the status on return, with the carry flag set on errors
+#define PCI_BIOS_FUNCTION_ID 0xb1
+
+#define PCI_BIOS_PRESENT     0x01
+#define PCI_BIOS_FIND_DEVICE 0x02
+#define PCI_BIOS_FIND_CLASS  0x03
+#define PCI_BIOS_READ_BYTE   0x08
+#define PCI_BIOS_READ_WORD   0x09
+#define PCI_BIOS_READ_DWORD  0x0a
+#define PCI_BIOS_WRITE_BYTE  0x0b
+#define PCI_BIOS_WRITE_WORD  0x0c
+#define PCI_BIOS_WRITE_DWORD 0x0d
+
+#define PCI_BIOS_SUCCESSFUL          0x00
+#define PCI_BIOS_FUNC_NOT_SUPPORTED  0x81
+#define PCI_BIOS_BAD_VENDOR_ID       0x83
+#define PCI_BIOS_DEVICE_NOT_FOUND    0x86
+#define PCI_BIOS_BAD_REGISTER_NUMBER 0x87
+
+void pci_bios_init();
+
+#endif
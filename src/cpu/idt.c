@@ -0,0 +1,23 @@
+#include <cpu/idt.h>
+
+// POST runs with interrupts disabled. The table only lets drivers halt until their device
+// interrupts, so every vector nobody set stays absent
+static struct idt_entry idt[IDT_ENTRIES];
+
+void idt_init() {
+    struct idt_register idt_reg;
+    idt_reg.base = (uint32_t) &idt;
+    idt_reg.limit = sizeof(idt) - 1;
+    __asm__ volatile("lidt %0" :: "m"(idt_reg));
+}
+
+// Handlers end with iret, and run on the code segment of the caller
+void idt_set(int vector, void (*handler)()) {
+    uint16_t cs;
+    __asm__ volatile("mov %%cs, %0" : "=r"(cs));
+    idt[vector].offset_low = (uint32_t) handler;
+    idt[vector].selector = cs;
+    idt[vector].reserved = 0;
+    idt[vector].flags = IDT_INTERRUPT_GATE;
+    idt[vector].offset_high = (uint32_t) handler >> 16;
+}
@@ -0,0 +1,25 @@
+#ifndef __CPU_IDT_H__
+#define __CPU_IDT_H__
+
+#include <stdint.h>
+
+#define IDT_ENTRIES 256
+#define IDT_INTERRUPT_GATE 0x8e // Present, ring 0, 32 bit interrupt gate
+
+struct idt_entry {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t reserved;
+    uint8_t flags;
+    uint16_t offset_high;
+} __attribute__((__packed__));
+
+struct idt_register {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((__packed__));
+
+void idt_init();
+void idt_set(int vector, void (*handler)());
+
+#endif
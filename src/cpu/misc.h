@@ -1,6 +1,8 @@
 #ifndef __CPU_MISC_H__
 #define __CPU_MISC_H__
 
+#include <stdint.h>
+
 static inline void pause() {
     __asm__ volatile("pause");
 }
@@ -17,4 +19,26 @@ static inline void sti() {
     __asm__ volatile("sti");
 }
 
+static inline uint64_t rdtsc() {
+    uint32_t eax;
+    uint32_t edx;
+    __asm__ volatile("rdtsc" : "=a"(eax), "=d"(edx));
+    return ((uint64_t) edx << 32) | eax;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    __asm__ volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+// Width of physical addresses, 36 bits (PAE) when the CPU doesn't report it
+static inline int cpu_phys_addr_bits() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000008) {
+        return 36;
+    }
+    cpuid(0x80000008, &eax, &ebx, &ecx, &edx);
+    return eax & 0xff;
+}
+
 #endif
@@ -0,0 +1,30 @@
+#ifndef __CPU_MMIO_H__
+#define __CPU_MMIO_H__
+
+#include <stdint.h>
+
+static inline uint8_t mmio_readb(uintptr_t address) {
+    return *(volatile uint8_t *) address;
+}
+
+static inline uint16_t mmio_readw(uintptr_t address) {
+    return *(volatile uint16_t *) address;
+}
+
+static inline uint32_t mmio_readd(uintptr_t address) {
+    return *(volatile uint32_t *) address;
+}
+
+static inline void mmio_writeb(uintptr_t address, uint8_t data) {
+    *(volatile uint8_t *) address = data;
+}
+
+static inline void mmio_writew(uintptr_t address, uint16_t data) {
+    *(volatile uint16_t *) address = data;
+}
+
+static inline void mmio_writed(uintptr_t address, uint32_t data) {
+    *(volatile uint32_t *) address = data;
+}
+
+#endif
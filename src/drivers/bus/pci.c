@@ -1,5 +1,8 @@
+#include <cpu/misc.h>
+#include <cpu/mmio.h>
 #include <cpu/pio.h>
 #include <drivers/bus/pci.h>
+#include <tools/alloc.h>
 #include <tools/print.h>
 #include <tools/string.h>
 
@@ -11,12 +14,199 @@ static struct pci_bar_window *pref_bar_window;
 static uint8_t (*get_interrupt_line)(int pin, uint8_t bus, uint8_t slot, uint8_t function);
 static int buses = 1;
 
+// Memory mapped configuration space (ECAM). When not set, the 0xcf8/0xcfc ports are used
+static uintptr_t ecam_base = 0;
+static int ecam_buses = 0;
+static uint32_t cfg_accesses = 0;
+
+// Inventory, with small indexes chaining together the functions of the same class and vendor buckets
+static struct pci_function inventory[PCI_MAX_FUNCTIONS];
+static int inventory_count = 0;
+static int last_bus = 0;
+static int rescanning = 0;
+static uint16_t class_head[PCI_CLASS_BUCKETS];
+static uint16_t class_next[PCI_MAX_FUNCTIONS];
+static uint16_t vendor_head[PCI_VENDOR_BUCKETS];
+static uint16_t vendor_next[PCI_MAX_FUNCTIONS];
+
+// Resources found by the first pass of the enumeration: BARs and bridge windows, each one linked
+// into the list of the window it sits behind, or into the root lists. They only live on the heap
+// until the second pass has assigned them
+#define PCI_MAX_RESOURCES 1024
+#define RESOURCE_NONE     0xffff
+#define RESOURCE_WINDOW   0xff
+#define RESOURCE_ROM      6
+#define RESOURCE_VF       8 // Up to 13, the BARs of SR-IOV virtual functions
+
+#define RESOURCE_IO   0
+#define RESOURCE_MEM  1
+#define RESOURCE_PREF 2
+
+struct pci_resource {
+    uint64_t size;
+    uint64_t align;
+    uint16_t next;
+    uint16_t children; // Windows only
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t function;
+    uint8_t bar; // Or RESOURCE_ROM, RESOURCE_VF + n, RESOURCE_WINDOW
+    uint8_t kind;
+    uint8_t is64;
+};
+
+static struct pci_resource *resources;
+static int resource_count;
+static uint64_t mmio_assigned;
+static uint64_t mmio_wasted;
+static int unassigned;
+// Prefetchable space left for resizable BARs, below and above 4GB
+static uint64_t rebar_room[2];
+static struct pci_hotplug_padding hotplug_padding = {
+    .buses = PCI_HOTPLUG_BUSES,
+    .io = PCI_HOTPLUG_IO,
+    .mem = PCI_HOTPLUG_MEM,
+    .pref = PCI_HOTPLUG_PREF,
+};
+
 /* Utilities */
 
-static void send_address(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset) {
+static void send_address(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset) {
     outd(PCI_CFG_ADDRESS, 0x80000000 | (bus << 16) | (slot << 11) | (function << 8) | (offset & 0xfc));
 }
 
+// Every configuration space access ends up here. With ECAM it is a single memory access,
+// otherwise the address is sent through 0xcf8 and the data goes through 0xcfc
+__attribute__((noinline)) static uint32_t cfg_access(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset, int size, int write, uint32_t data) {
+    cfg_accesses++;
+    if (ecam_base && bus < ecam_buses) {
+        uintptr_t ecam = ecam_base + (((uint32_t) bus << 20) | ((uint32_t) slot << 15) | ((uint32_t) function << 12) | (offset & 0xfff));
+        if (size == 1) {
+            if (write) {
+                mmio_writeb(ecam, data);
+                return 0;
+            }
+            return mmio_readb(ecam);
+        } else if (size == 2) {
+            if (write) {
+                mmio_writew(ecam, data);
+                return 0;
+            }
+            return mmio_readw(ecam);
+        }
+        if (write) {
+            mmio_writed(ecam, data);
+            return 0;
+        }
+        return mmio_readd(ecam);
+    }
+    // The extended configuration space is only reachable through ECAM
+    if (offset >= PCI_CFG_SPACE_SIZE) {
+        return 0xffffffff;
+    }
+    send_address(bus, slot, function, offset);
+    if (size == 1) {
+        if (write) {
+            outb(PCI_CFG_DATA + (offset & 3), data);
+            return 0;
+        }
+        return inb(PCI_CFG_DATA + (offset & 3));
+    } else if (size == 2) {
+        if (write) {
+            outw(PCI_CFG_DATA + (offset & 2), data);
+            return 0;
+        }
+        return inw(PCI_CFG_DATA + (offset & 2));
+    }
+    if (write) {
+        outd(PCI_CFG_DATA, data);
+        return 0;
+    }
+    return ind(PCI_CFG_DATA);
+}
+
+static int scan_bus_vendors(uint8_t bus) {
+    int found = 0;
+    for (int i = 0; i < 32; i++) {
+        if (pci_cfg_read_word(bus, i, 0, PCI_CFG_VENDOR) != 0xffff) {
+            found++;
+        }
+    }
+    return found;
+}
+
+static uint64_t read_bar(uint8_t bus, uint8_t slot, uint8_t function, int bar) {
+    uint32_t bar_val = pci_cfg_read_dword(bus, slot, function, PCI_CFG_BAR0 + (bar * 4));
+    if (bar_val & 1) {
+        // I/O bar
+        return (uint64_t) ((uint16_t) bar_val & ~0x03);
+    }
+    if (((bar_val >> 1) & 0x03) == 0) {
+        // 32-bit MMIO bar
+        return (uint64_t) (bar_val & ~0x0f);
+    }
+    if (((bar_val >> 1) & 0x03) == 2) {
+        // 64-bit MMIO bar
+        return ((uint64_t) pci_cfg_read_dword(bus, slot, function, PCI_CFG_BAR0 + ((bar + 1) * 4)) << 32) | (bar_val & ~0x0f);
+    }
+    return 0;
+}
+
+static int class_bucket(uint8_t class) {
+    return PCI_CLASS_BUCKET(class);
+}
+
+static int vendor_bucket(uint16_t vendor) {
+    return PCI_VENDOR_BUCKET(vendor);
+}
+
+static struct pci_function *inventory_add(uint8_t bus, uint8_t slot, uint8_t function, uint8_t header) {
+    if (inventory_count == PCI_MAX_FUNCTIONS) {
+        print("PCI: Inventory full, Bus %d Slot %d Function %d won't be visible to drivers", bus, slot, function);
+        return NULL;
+    }
+    struct pci_function *entry = &inventory[inventory_count++];
+    entry->bus = bus;
+    entry->slot = slot;
+    entry->function = function;
+    entry->header = header;
+    entry->vendor = pci_cfg_read_word(bus, slot, function, PCI_CFG_VENDOR);
+    entry->device = pci_cfg_read_word(bus, slot, function, PCI_CFG_DEVICE);
+    entry->class = pci_cfg_read_byte(bus, slot, function, PCI_CFG_CLASS);
+    entry->subclass = pci_cfg_read_byte(bus, slot, function, PCI_CFG_SUBCLASS);
+    entry->interface = pci_cfg_read_byte(bus, slot, function, PCI_CFG_INTERFACE);
+    entry->subsystem_vendor = 0xffff;
+    entry->subsystem_device = 0xffff;
+    if (header == 0x00) {
+        entry->subsystem_vendor = pci_cfg_read_word(bus, slot, function, PCI_CFG_SUBSYSTEM_VENDOR);
+        entry->subsystem_device = pci_cfg_read_word(bus, slot, function, PCI_CFG_SUBSYSTEM_DEVICE);
+    }
+    return entry;
+}
+
+// Called once the function has its resources assigned
+static void inventory_finish(struct pci_function *entry) {
+    entry->interrupt_line = pci_cfg_read_byte(entry->bus, entry->slot, entry->function, PCI_CFG_INTERRUPT_LINE);
+    int bars = entry->header == 0x00 ? 6 : entry->header == 0x01 ? 2 : 0;
+    for (int i = 0; i < 6; i++) {
+        entry->bars[i] = i < bars ? read_bar(entry->bus, entry->slot, entry->function, i) : 0;
+    }
+}
+
+// The chains are built backwards so they keep the enumeration order
+static void inventory_index() {
+    memset(class_head, 0xff, sizeof(class_head));
+    memset(vendor_head, 0xff, sizeof(vendor_head));
+    for (int i = inventory_count - 1; i >= 0; i--) {
+        int class = class_bucket(inventory[i].class);
+        int vendor = vendor_bucket(inventory[i].vendor);
+        class_next[i] = class_head[class];
+        class_head[class] = i;
+        vendor_next[i] = vendor_head[vendor];
+        vendor_head[vendor] = i;
+    }
+}
+
 static int get_bar_type(uint32_t bar) {
     if (bar & 1) {
         return PCI_BAR_IO;
@@ -24,211 +214,354 @@ static int get_bar_type(uint32_t bar) {
     return (bar & 0x0f) >> 1;
 }
 
+static int bar_is_64(int type) {
+    return type == PCI_BAR_MEM_64 || type == PCI_BAR_PREF_64;
+}
+
+static uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + (align - 1)) & ~(align - 1);
+}
+
 static int allocate_bus() {
     return buses++;
 }
 
-static int allocate_bar(uint8_t bus, uint8_t slot, uint8_t function, int bar) {
-    int offset = PCI_CFG_BAR0 + (bar * 4);
-    uint64_t bar_orig_value = (uint64_t) pci_cfg_read_dword(bus, slot, function, offset);
-    uint64_t bar_size = 0;
-    int type = get_bar_type((uint32_t) bar_orig_value);
-    if (type == PCI_BAR_IO) {
-        pci_cfg_write_dword(bus, slot, function, offset, 0xffffffff);
-        bar_size = (uint64_t) pci_cfg_read_dword(bus, slot, function, offset);
-        bar_size &= ~0x03;
-        bar_size = ~((uint32_t) bar_size) + 1;
-        pci_cfg_write_dword(bus, slot, function, offset, (uint32_t) bar_orig_value);
-    } else if (type == PCI_BAR_MEM_32 || type == PCI_BAR_PREF_32) {
-        pci_cfg_write_dword(bus, slot, function, offset, 0xffffffff);
-        bar_size = pci_cfg_read_dword(bus, slot, function, offset);
-        bar_size &= ~0x0f;
-        bar_size = ~((uint32_t) bar_size) + 1;
-        pci_cfg_write_dword(bus, slot, function, offset, (uint32_t) bar_orig_value);
-    } else if (type == PCI_BAR_MEM_64 || type == PCI_BAR_PREF_64) {
-        bar_orig_value |= ((uint64_t) pci_cfg_read_dword(bus, slot, function, offset + 4) << 32);
-        // Lower half of size
-        pci_cfg_write_dword(bus, slot, function, offset, 0xffffffff);
-        bar_size = pci_cfg_read_dword(bus, slot, function, offset);
-        bar_size &= ~0x0f;
-        bar_size = ~((uint32_t) bar_size) + 1;
-        pci_cfg_write_dword(bus, slot, function, offset, (uint32_t) bar_orig_value);
-        // Higher half of size
+static struct pci_resource *resource_add(uint16_t *list, uint8_t bus, uint8_t slot, uint8_t function, int bar, int kind, uint64_t size) {
+    if (resource_count == PCI_MAX_RESOURCES) {
+        print("PCI: Too many resources, BAR #%d of Bus %d Slot %d Function %d won't be assigned", bar, bus, slot, function);
+        return NULL;
+    }
+    struct pci_resource *resource = &resources[resource_count];
+    resource->size = size;
+    resource->align = size;
+    resource->children = RESOURCE_NONE;
+    resource->bus = bus;
+    resource->slot = slot;
+    resource->function = function;
+    resource->bar = bar;
+    resource->kind = kind;
+    resource->is64 = 0;
+    resource->next = *list;
+    *list = resource_count++;
+    return resource;
+}
+
+// Insertion sort by descending alignment. Packing BARs in that order leaves no holes between them,
+// since every one of them is a multiple of the alignment of those after it. Windows are only
+// rounded to their granularity, so the ones after a window may still need padding
+static void sort_resources(uint16_t *list) {
+    uint16_t sorted = RESOURCE_NONE;
+    uint16_t i = *list;
+    while (i != RESOURCE_NONE) {
+        uint16_t next = resources[i].next;
+        uint16_t *link = &sorted;
+        while (*link != RESOURCE_NONE && resources[*link].align >= resources[i].align) {
+            link = &resources[*link].next;
+        }
+        resources[i].next = *link;
+        *link = i;
+        i = next;
+    }
+    *list = sorted;
+}
+
+// Where the BAR is in configuration space, including the ROM and the VF BARs
+static int bar_offset(uint8_t bus, uint8_t slot, uint8_t function, int bar) {
+    if (bar == RESOURCE_ROM) {
+        return PCI_CFG_EXPANSION_ROM;
+    } else if (bar >= RESOURCE_VF) {
+        return pci_ext_cap_find(bus, slot, function, PCI_EXT_CAP_SRIOV, 0) + PCI_SRIOV_BAR0 + ((bar - RESOURCE_VF) * 4);
+    }
+    return PCI_CFG_BAR0 + (bar * 4);
+}
+
+// Returns the size of the BAR, 0 if it isn't implemented. Its value is left untouched
+static uint64_t probe_bar(uint8_t bus, uint8_t slot, uint8_t function, int bar, int *type_ptr) {
+    int offset = bar_offset(bus, slot, function, bar);
+    uint32_t orig = pci_cfg_read_dword(bus, slot, function, offset);
+    int type = get_bar_type(orig);
+    *type_ptr = type;
+    uint64_t mask;
+    // The upper half goes first: a BAR of 4 GB or more has no writable bits in the lower one
+    if (bar_is_64(type)) {
+        uint32_t orig_hi = pci_cfg_read_dword(bus, slot, function, offset + 4);
         pci_cfg_write_dword(bus, slot, function, offset + 4, 0xffffffff);
-        bar_size |= (uint64_t) ~pci_cfg_read_dword(bus, slot, function, offset + 4) << 32;
-        pci_cfg_write_dword(bus, slot, function, offset + 4, (uint32_t) (bar_orig_value >> 32));
+        mask = (uint64_t) pci_cfg_read_dword(bus, slot, function, offset + 4) << 32;
+        pci_cfg_write_dword(bus, slot, function, offset + 4, orig_hi);
+    } else {
+        // IO BARs may only decode 16 bits
+        mask = type == PCI_BAR_IO ? 0xffffffffffff0000 : 0xffffffff00000000;
+    }
+    pci_cfg_write_dword(bus, slot, function, offset, 0xffffffff);
+    uint32_t mask_lo = pci_cfg_read_dword(bus, slot, function, offset) & (type == PCI_BAR_IO ? ~0x03 : ~0x0f);
+    pci_cfg_write_dword(bus, slot, function, offset, orig);
+    if (!mask_lo && !(bar_is_64(type) && mask)) {
+        return 0;
     }
+    mask |= mask_lo;
+    return ~mask + 1;
+}
+
+// First pass: size the BAR and queue it on the list of its kind, without assigning anything.
+// count copies of it go back to back, aligned like a single one
+static int size_bar(uint8_t bus, uint8_t slot, uint8_t function, int bar, int count, uint16_t **lists) {
+    int type;
+    uint64_t size = probe_bar(bus, slot, function, bar, &type);
     // Does the BAR exist?
-    if (!bar_size) {
-        pci_cfg_write_dword(bus, slot, function, offset, 0);
+    if (!size) {
+        pci_cfg_write_dword(bus, slot, function, bar_offset(bus, slot, function, bar), 0);
         return -1;
     }
-allocate_io:
-    if (type == PCI_BAR_IO) {
-        uint64_t temp_io_base = io_bar_window->base;
-        temp_io_base = (temp_io_base + (bar_size - 1)) & ~(bar_size - 1);
-        if (temp_io_base + bar_size > io_bar_window->limit) {
-            if (io_bar_window->next) {
-                io_bar_window = io_bar_window->next;
-                goto allocate_io;
-            }
-            print("PCI: Cannot allocate IO BAR #%d of Bus %d Slot %d Function %d because there isn't any space left on any IO window", bar, bus, slot, function);
-            print("Halting");
-            for (;;) {}
-        }
-        pci_cfg_write_dword(bus, slot, function, offset, temp_io_base);
-        io_bar_window->base = temp_io_base + bar_size;
-    }
-allocate_mem:
-    if (type == PCI_BAR_MEM_32 || type == PCI_BAR_MEM_64) {
-        uint64_t temp_mem_base = mem_bar_window->base;
-        temp_mem_base = (temp_mem_base + (bar_size - 1)) & ~(bar_size - 1);
-        if (temp_mem_base + bar_size > mem_bar_window->limit) {
-            if (mem_bar_window->next) {
-                mem_bar_window = mem_bar_window->next;
-                goto allocate_mem;
-            }
-            print("PCI: Cannot allocate Memory BAR #%d of Bus %d Slot %d Function %d because there isn't any space left on any Memory window", bar, bus, slot, function);
-            print("Halting");
-            for (;;) {}
-        }
-        pci_cfg_write_dword(bus, slot, function, offset, temp_mem_base);
-        if ((temp_mem_base >> 32) && type == PCI_BAR_PREF_32) {
-            print("PCI: Cannot allocate Memory BAR #%d of Bus %d Slot %d Function %d because it's 32 bit and the window is above 4GB", bar, bus, slot, function);
-            print("Halting");
-            for (;;) {}
-        }
-        if (type == PCI_BAR_MEM_64) {
-            pci_cfg_write_dword(bus, slot, function, offset + 4, (uint32_t) (temp_mem_base >> 32));
-        }
-        mem_bar_window->base = temp_mem_base + bar_size;
-    }
-allocate_pref:
-    if (type == PCI_BAR_PREF_32 || type == PCI_BAR_PREF_64) {
-        uint64_t temp_pref_base = pref_bar_window->base;
-        temp_pref_base = (temp_pref_base + (bar_size - 1)) & ~(bar_size - 1);
-        if (temp_pref_base + bar_size > pref_bar_window->limit) {
-            if (pref_bar_window->next) {
-                pref_bar_window = pref_bar_window->next;
-                goto allocate_pref;
+    int kind = type == PCI_BAR_IO ? RESOURCE_IO : (type & PCI_BAR_PREF_32) ? RESOURCE_PREF : RESOURCE_MEM;
+    if (!lists[kind]) {
+        print("PCI: BAR #%d of Bus %d Slot %d Function %d sits behind a bridge that doesn't forward it", bar, bus, slot, function);
+        return type;
+    }
+    struct pci_resource *resource = resource_add(lists[kind], bus, slot, function, bar, kind, size * count);
+    if (resource) {
+        resource->align = size;
+        resource->is64 = bar_is_64(type);
+    }
+    return type;
+}
+
+// The VF BARs get room for every VF the device can have, so that enabling them later doesn't need
+// anything moved. The VFs themselves are left disabled
+static void size_vf_bars(uint8_t bus, uint8_t slot, uint8_t function, uint16_t **lists) {
+    uint16_t cap = pci_ext_cap_find(bus, slot, function, PCI_EXT_CAP_SRIOV, 0);
+    if (!cap) {
+        return;
+    }
+    int total = pci_cfg_read_word(bus, slot, function, cap + PCI_SRIOV_TOTAL_VFS);
+    print("PCI: Bus %d Slot %d Function %d supports SR-IOV with %d VFs", bus, slot, function, total);
+    if (!total) {
+        return;
+    }
+    for (int i = 0; i < 6; i++) {
+        if (bar_is_64(size_bar(bus, slot, function, RESOURCE_VF + i, total, lists))) {
+            i++;
+        }
+    }
+}
+
+// Grow every resizable BAR of the function to the largest size it supports, up to 1 GB, that still
+// fits in what is left of the prefetchable windows. Runs before the BARs are sized and before decoding
+// is turned on, as the size must not change while the BAR decodes
+static void negotiate_rebar(uint8_t bus, uint8_t slot, uint8_t function) {
+    uint16_t cap = pci_ext_cap_find(bus, slot, function, PCI_EXT_CAP_REBAR, 0);
+    if (!cap) {
+        return;
+    }
+    int count = (pci_cfg_read_dword(bus, slot, function, cap + PCI_REBAR_CONTROL) >> 5) & 0x07;
+    for (int i = 0; i < count; i++) {
+        uint16_t entry = cap + (i * 8);
+        // Bit n of the supported sizes stands for 1MB << n
+        uint32_t sizes = pci_cfg_read_dword(bus, slot, function, entry + PCI_REBAR_CAPABILITY) >> 4;
+        uint32_t control = pci_cfg_read_dword(bus, slot, function, entry + PCI_REBAR_CONTROL);
+        int bar = control & 0x07;
+        int current = (control >> 8) & 0x3f;
+        uint64_t *room = &rebar_room[bar_is_64(get_bar_type(pci_cfg_read_dword(bus, slot, function, PCI_CFG_BAR0 + (bar * 4))))];
+        int best = current;
+        for (int n = PCI_REBAR_MAX_ORDER; n > current; n--) {
+            if (((sizes >> n) & 1) && ((uint64_t) 0x100000 << n) <= *room) {
+                best = n;
+                break;
             }
-            print("PCI: Cannot allocate Prefetchable BAR #%d of Bus %d Slot %d Function %d because there isn't any space left on any Prefetchable window", bar, bus, slot, function);
-            print("Halting");
-            for (;;) {}
         }
-        pci_cfg_write_dword(bus, slot, function, offset, temp_pref_base);
-        if ((temp_pref_base >> 32) && type == PCI_BAR_PREF_32) {
-            print("PCI: Cannot allocate Prefetchable BAR #%d of Bus %d Slot %d Function %d because it's 32 bit and the window is above 4GB", bar, bus, slot, function);
-            print("Halting");
-            for (;;) {}
+        if (best != current) {
+            pci_cfg_write_dword(bus, slot, function, entry + PCI_REBAR_CONTROL, (control & ~0x3f00) | (best << 8));
+            print("PCI: Resized BAR #%d of Bus %d Slot %d Function %d to %d MB", bar, bus, slot, function, 1 << best);
         }
-        if (type == PCI_BAR_PREF_64) {
-            pci_cfg_write_dword(bus, slot, function, offset + 4, (uint32_t) (temp_pref_base >> 32));
+        uint64_t size = (uint64_t) 0x100000 << best;
+        *room = size < *room ? *room - size : 0;
+    }
+}
+
+// A bridge window needs room for everything behind it, packed, rounded to the window granularity
+static void size_window(struct pci_resource *window) {
+    uint64_t granularity = window->kind == RESOURCE_IO ? 0x1000 : 0x100000;
+    sort_resources(&window->children);
+    uint64_t end = 0;
+    for (uint16_t i = window->children; i != RESOURCE_NONE; i = resources[i].next) {
+        end = align_up(end, resources[i].align) + resources[i].size;
+        // A single 32 bit BAR behind it keeps the whole window below 4 GB
+        if (!resources[i].is64) {
+            window->is64 = 0;
         }
-        pref_bar_window->base = temp_pref_base + bar_size;
     }
-    return type;
+    window->size = align_up(end, granularity);
+    window->align = granularity;
+    if (window->children != RESOURCE_NONE && resources[window->children].align > granularity) {
+        window->align = resources[window->children].align;
+    }
 }
 
-static void setup_device(uint8_t bus, uint8_t slot, uint8_t function) {
+static void setup_device(uint8_t bus, uint8_t slot, uint8_t function, uint16_t **lists) {
     print("PCI: Device found on Bus %d Slot %d Function %d", bus, slot, function);
     for (int i = 0; i < 6; i++) {
-        int type = allocate_bar(bus, slot, function, i);
-        if (type == PCI_BAR_MEM_64 || type == PCI_BAR_PREF_64) {
+        if (bar_is_64(size_bar(bus, slot, function, i, 1, lists))) {
             i++;
         }
     }
+    // The expansion ROM gets 32 bit memory space like any BAR, but is left with decoding disabled
+    pci_cfg_write_dword(bus, slot, function, PCI_CFG_EXPANSION_ROM, PCI_ROM_ADDRESS_MASK);
+    uint32_t rom_mask = pci_cfg_read_dword(bus, slot, function, PCI_CFG_EXPANSION_ROM) & PCI_ROM_ADDRESS_MASK;
+    pci_cfg_write_dword(bus, slot, function, PCI_CFG_EXPANSION_ROM, 0);
+    if (rom_mask && lists[RESOURCE_MEM]) {
+        resource_add(lists[RESOURCE_MEM], bus, slot, function, RESOURCE_ROM, RESOURCE_MEM, ~rom_mask + 1);
+    }
+    size_vf_bars(bus, slot, function, lists);
+}
+
+// How much of a secondary bus is worth scanning
+#define SCAN_NONE    0
+#define SCAN_DEVICE0 1
+#define SCAN_ARI     2
+#define SCAN_ALL     3
+
+static void setup_bus(uint8_t bus, uint16_t **lists, int scan);
+
+// A PCI Express port links to a single device, so only device 0 can answer behind it, and
+// nothing at all when the slot or the link say so. With ARI that device can have up to 256 functions
+// Returns the offset of the PCI Express capability of root and downstream ports, 0 for anything else
+static uint8_t pcie_port_cap(uint8_t bus, uint8_t slot, uint8_t function) {
+    uint8_t cap = pci_cap_find(bus, slot, function, PCI_CAP_PCIE, 0);
+    if (!cap) {
+        return 0;
+    }
+    int type = PCI_PCIE_CAPS_TYPE(pci_cfg_read_word(bus, slot, function, cap + PCI_PCIE_CAPS));
+    return type == PCI_PCIE_TYPE_ROOT_PORT || type == PCI_PCIE_TYPE_DOWNSTREAM ? cap : 0;
 }
 
-static int setup_bus(uint8_t bus);
+static int hotplug_capable(uint8_t bus, uint8_t slot, uint8_t function) {
+    uint8_t cap = pcie_port_cap(bus, slot, function);
+    return cap && (pci_cfg_read_word(bus, slot, function, cap + PCI_PCIE_CAPS) & PCI_PCIE_CAPS_SLOT)
+        && (pci_cfg_read_dword(bus, slot, function, cap + PCI_PCIE_SLOT_CAP) & PCI_PCIE_SLOT_CAP_HOTPLUG);
+}
 
-static void setup_pci_bridge(uint8_t bus, uint8_t slot, uint8_t function, int *found_buses) {
+static int secondary_scan(uint8_t bus, uint8_t slot, uint8_t function, uint8_t secondary) {
+    uint8_t cap = pcie_port_cap(bus, slot, function);
+    if (!cap) {
+        return SCAN_ALL;
+    }
+    uint16_t caps = pci_cfg_read_word(bus, slot, function, cap + PCI_PCIE_CAPS);
+    if ((caps & PCI_PCIE_CAPS_SLOT) && !(pci_cfg_read_word(bus, slot, function, cap + PCI_PCIE_SLOT_STATUS) & PCI_PCIE_SLOT_STATUS_PRESENCE)) {
+        return SCAN_NONE;
+    }
+    if ((pci_cfg_read_dword(bus, slot, function, cap + PCI_PCIE_LINK_CAP) & PCI_PCIE_LINK_CAP_DLL_REPORT)
+        && !(pci_cfg_read_word(bus, slot, function, cap + PCI_PCIE_LINK_STATUS) & PCI_PCIE_LINK_STATUS_DLL)) {
+        return SCAN_NONE;
+    }
+    if ((pci_cfg_read_dword(bus, slot, function, cap + PCI_PCIE_DEVICE_CAP2) & PCI_PCIE_DEVICE_CAP2_ARI)
+        && pci_cfg_read_word(secondary, 0, 0, PCI_CFG_VENDOR) != 0xffff
+        && pci_ext_cap_find(secondary, 0, 0, PCI_EXT_CAP_ARI, 0)) {
+        uint16_t control = pci_cfg_read_word(bus, slot, function, cap + PCI_PCIE_DEVICE_CONTROL2);
+        pci_cfg_write_word(bus, slot, function, cap + PCI_PCIE_DEVICE_CONTROL2, control | PCI_PCIE_DEVICE_CONTROL2_ARI);
+        return SCAN_ARI;
+    }
+    return SCAN_DEVICE0;
+}
+
+static void setup_pci_bridge(uint8_t bus, uint8_t slot, uint8_t function, uint16_t **lists) {
     print("PCI: PCI bridge found on Bus %d Slot %d Function %d", bus, slot, function);
-    // Allocate those 2 BARs
     for (int i = 0; i < 2; i++) {
-        int type = allocate_bar(bus, slot, function, i);
-        if (type == PCI_BAR_MEM_64 || type == PCI_BAR_PREF_64) {
+        if (bar_is_64(size_bar(bus, slot, function, i, 1, lists))) {
             break;
         }
     }
-    // Figure out what kind of memory the bridge accepts
-    int io_implemented = 1;
-    int mem_implemented = 1;
-    int pref_implemented = 1;
+    // Figure out what kind of memory the bridge forwards, each kind gets a window in the parent's lists
+    struct pci_resource *windows[3] = {NULL, NULL, NULL};
     pci_cfg_write_byte(bus, slot, function, PCI_CFG_IO_BASE, 0xff);
-    if (pci_cfg_read_byte(bus, slot, function, PCI_CFG_IO_BASE) == 0x00) {
-        io_implemented = 0;
+    if (pci_cfg_read_byte(bus, slot, function, PCI_CFG_IO_BASE) != 0x00 && lists[RESOURCE_IO]) {
+        windows[RESOURCE_IO] = resource_add(lists[RESOURCE_IO], bus, slot, function, RESOURCE_WINDOW, RESOURCE_IO, 0);
     }
     pci_cfg_write_word(bus, slot, function, PCI_CFG_MEMORY_BASE, 0xffff);
-    if (pci_cfg_read_word(bus, slot, function, PCI_CFG_MEMORY_BASE) == 0x0000) {
-        mem_implemented = 0;
+    if (pci_cfg_read_word(bus, slot, function, PCI_CFG_MEMORY_BASE) != 0x0000 && lists[RESOURCE_MEM]) {
+        windows[RESOURCE_MEM] = resource_add(lists[RESOURCE_MEM], bus, slot, function, RESOURCE_WINDOW, RESOURCE_MEM, 0);
     }
     pci_cfg_write_word(bus, slot, function, PCI_CFG_PREFETCH_BASE, 0xffff);
-    if (pci_cfg_read_word(bus, slot, function, PCI_CFG_PREFETCH_BASE) == 0x0000) {
-        pref_implemented = 0;
-    }
-    // Align memory, IO and prefetchable bases
-    if (io_implemented) {
-        io_bar_window->base = (io_bar_window->base + 0x0fff) & ~0x0fff;
+    uint16_t pref_base = pci_cfg_read_word(bus, slot, function, PCI_CFG_PREFETCH_BASE);
+    if (pref_base != 0x0000 && lists[RESOURCE_PREF]) {
+        windows[RESOURCE_PREF] = resource_add(lists[RESOURCE_PREF], bus, slot, function, RESOURCE_WINDOW, RESOURCE_PREF, 0);
+        if (windows[RESOURCE_PREF]) {
+            windows[RESOURCE_PREF]->is64 = (pref_base & 0x0f) == PCI_PREFETCH_64;
+        }
     }
-    if (mem_implemented) {
-        mem_bar_window->base = (mem_bar_window->base + 0xffffe) & ~0xffffe;
+    uint16_t *child_lists[3];
+    for (int i = 0; i < 3; i++) {
+        child_lists[i] = windows[i] ? &windows[i]->children : NULL;
     }
-    if (pref_implemented) {
-        pref_bar_window->base = (pref_bar_window->base + 0xffffe) & ~0xffffe;
+    // Prefetchable memory can always go through a non prefetchable window
+    if (!windows[RESOURCE_PREF]) {
+        child_lists[RESOURCE_PREF] = child_lists[RESOURCE_MEM];
     }
-    uintptr_t orig_mem_base = mem_bar_window->base;
-    uint16_t orig_io_base = io_bar_window->base;
-    uintptr_t orig_pref_base = pref_bar_window->base;
     // Assign bus numbers
     int new_bus = allocate_bus();
     pci_cfg_write_byte(bus, slot, function, PCI_CFG_PRIMARY_BUS, bus);
     pci_cfg_write_byte(bus, slot, function, PCI_CFG_SECONDARY_BUS, new_bus);
     pci_cfg_write_byte(bus, slot, function, PCI_CFG_SUBORDINATE_BUS, 0xff);
-    pci_cfg_write_byte(bus, slot, function, PCI_CFG_SUBORDINATE_BUS, new_bus + setup_bus(new_bus));
-    // Tell the bridge what ranges it can use
-    if (io_implemented) {
-        pci_cfg_write_byte(bus, slot, function, PCI_CFG_IO_BASE, (orig_io_base >> 11) << 3);
-        pci_cfg_write_byte(bus, slot, function, PCI_CFG_IO_LIMIT, (io_bar_window->base >> 11) << 3);
-        pci_cfg_write_word(bus, slot, function, PCI_CFG_IO_BASE_HI, 0);
-        pci_cfg_write_word(bus, slot, function, PCI_CFG_IO_LIMIT_HI, 0);
-        io_bar_window->base++;
-        io_bar_window->base = (io_bar_window->base + 0x0fff) & ~0x0fff;
-    }
-    if (mem_implemented) {
-        pci_cfg_write_word(bus, slot, function, PCI_CFG_MEMORY_BASE, (orig_mem_base >> 19) << 3);
-        pci_cfg_write_word(bus, slot, function, PCI_CFG_MEMORY_LIMIT, (mem_bar_window->base >> 19) << 3);
-        mem_bar_window->base++;
-        mem_bar_window->base = (mem_bar_window->base + 0xffffe) & ~0xffffe;
-    }
-    if (pref_implemented) {
-        pci_cfg_write_word(bus, slot, function, PCI_CFG_PREFETCH_BASE, (orig_pref_base >> 19) << 3);
-        pci_cfg_write_word(bus, slot, function, PCI_CFG_PREFETCH_LIMIT, (pref_bar_window->base >> 19) << 3);
-        pci_cfg_write_dword(bus, slot, function, PCI_CFG_PREFETCH_BASE_HI, 0);
-        pci_cfg_write_dword(bus, slot, function, PCI_CFG_PREFETCH_LIMIT_HI, 0);
-        pref_bar_window->base++;
-        pref_bar_window->base = (pref_bar_window->base + 0xffffe) & ~0xffffe;
-    }
-    *found_buses = *found_buses + 1;
+    int scan = secondary_scan(bus, slot, function, new_bus);
+    if (scan == SCAN_NONE) {
+        print("PCI: Nothing behind Bus %d Slot %d Function %d, not scanning Bus %d", bus, slot, function, new_bus);
+    }
+    setup_bus(new_bus, child_lists, scan);
+    // Hotplug capable ports are padded, so that whatever is added later fits in place
+    int hotplug = hotplug_capable(bus, slot, function);
+    if (hotplug && buses - new_bus < hotplug_padding.buses) {
+        buses = new_bus + hotplug_padding.buses;
+    }
+    pci_cfg_write_byte(bus, slot, function, PCI_CFG_SUBORDINATE_BUS, buses - 1);
+    if (buses - 1 > last_bus) {
+        last_bus = buses - 1 > 0xff ? 0xff : buses - 1;
+    }
+    uint64_t padding[3] = {hotplug_padding.io, hotplug_padding.mem, hotplug_padding.pref};
+    for (int i = 0; i < 3; i++) {
+        if (windows[i]) {
+            size_window(windows[i]);
+            if (hotplug && windows[i]->size < padding[i]) {
+                windows[i]->size = align_up(padding[i], windows[i]->align);
+            }
+        }
+    }
+    if (hotplug) {
+        print("PCI: Hotplug port on Bus %d Slot %d Function %d gets buses %d-%d", bus, slot, function, new_bus, buses - 1);
+    }
 }
 
 static void setup_cardbus_bridge(uint8_t bus, uint8_t slot, uint8_t function) {
     print("PCI: Cardbus bridge found on Bus %d Slot %d Function %d, ignoring", bus, slot, function);
 }
 
-static void setup_function(uint8_t bus, uint8_t slot, uint8_t function, int *found_buses) {
+static void setup_function(uint8_t bus, uint8_t slot, uint8_t function, uint16_t **lists) {
     if (pci_cfg_read_word(bus, slot, function, PCI_CFG_VENDOR) == 0xffff) {
         return;
     }
     uint8_t header = pci_cfg_read_byte(bus, slot, function, PCI_CFG_HEADER) & ~PCI_CFG_HEADER_MULTIFUNCTION;
-    pci_control_set(bus, slot, function, PCI_CFG_COMMAND_MEM_ENABLE | PCI_CFG_COMMAND_IO_ENABLE);
+    inventory_add(bus, slot, function, header);
+    if (rescanning) {
+        // Only walk what is already configured
+        uint8_t secondary = pci_cfg_read_byte(bus, slot, function, PCI_CFG_SECONDARY_BUS);
+        if (header == 0x01 && secondary > bus) {
+            uint8_t subordinate = pci_cfg_read_byte(bus, slot, function, PCI_CFG_SUBORDINATE_BUS);
+            if (subordinate > last_bus) {
+                last_bus = subordinate;
+            }
+            setup_bus(secondary, lists, secondary_scan(bus, slot, function, secondary));
+        }
+        return;
+    }
+    if (header == 0x00) {
+        negotiate_rebar(bus, slot, function);
+    }
+    // Decoding stays off while the BARs are sized, the second pass turns it on once they are placed
+    pci_control_clear(bus, slot, function, PCI_CFG_COMMAND_MEM_ENABLE | PCI_CFG_COMMAND_IO_ENABLE);
     pci_cfg_write_byte(bus, slot, function, PCI_CFG_INTERRUPT_LINE, get_interrupt_line(
         pci_cfg_read_byte(bus, slot, function, PCI_CFG_INTERRUPT_PIN), bus, slot, function
     ));
     if (header == 0x00) {
-        setup_device(bus, slot, function);
+        setup_device(bus, slot, function, lists);
     } else if (header == 0x01) {
-        setup_pci_bridge(bus, slot, function, found_buses);
+        setup_pci_bridge(bus, slot, function, lists);
     } else if (header == 0x02) {
         setup_cardbus_bridge(bus, slot, function);
     } else {
@@ -236,22 +569,191 @@ static void setup_function(uint8_t bus, uint8_t slot, uint8_t function, int *fou
     }
 }
 
-static void setup_slot(uint8_t bus, uint8_t slot, int *found_buses) {
+static void setup_slot(uint8_t bus, uint8_t slot, uint16_t **lists) {
     if (pci_cfg_read_word(bus, slot, 0, PCI_CFG_VENDOR) == 0xffff) {
         return;
     }
     int functions = pci_cfg_read_byte(bus, slot, 0, PCI_CFG_HEADER) & PCI_CFG_HEADER_MULTIFUNCTION ? 8 : 1;
     for (int i = 0; i < functions; i++) {
-        setup_function(bus, slot, i, found_buses);
+        setup_function(bus, slot, i, lists);
     }
 }
 
-static int setup_bus(uint8_t bus) {
-    int found_buses = 0;
-    for (int i = 0; i < 32; i++) {
-        setup_slot(bus, i, &found_buses);
+static void setup_bus(uint8_t bus, uint16_t **lists, int scan) {
+    if (scan != SCAN_ARI) {
+        int slots = scan == SCAN_ALL ? 32 : scan == SCAN_DEVICE0 ? 1 : 0;
+        for (int i = 0; i < slots; i++) {
+            setup_slot(bus, i, lists);
+        }
+        return;
+    }
+    // Follow the chain of ARI functions, the slot and function numbers are just the two halves of it
+    int next = 0;
+    for (int i = 0; i < 256; i++) {
+        uint8_t slot = next >> 3;
+        uint8_t function = next & 0x07;
+        if (pci_cfg_read_word(bus, slot, function, PCI_CFG_VENDOR) == 0xffff) {
+            return;
+        }
+        setup_function(bus, slot, function, lists);
+        uint16_t ari = pci_ext_cap_find(bus, slot, function, PCI_EXT_CAP_ARI, 0);
+        next = ari ? PCI_ARI_NEXT(pci_cfg_read_dword(bus, slot, function, ari + PCI_ARI_CAPABILITY)) : 0;
+        if (!next) {
+            return;
+        }
+    }
+}
+
+static uint16_t decode_bit(struct pci_resource *resource) {
+    return resource->kind == RESOURCE_IO ? PCI_CFG_COMMAND_IO_ENABLE : PCI_CFG_COMMAND_MEM_ENABLE;
+}
+
+// Second pass: the resource gets its final address, and the function starts decoding its kind of
+// space. Windows program the bridge and place what is behind them back to back, in the order the
+// first pass sorted them. VF BARs are decoded by the VFs, which stay disabled
+static void assign_resource(struct pci_resource *resource, uint64_t base) {
+    uint8_t bus = resource->bus;
+    uint8_t slot = resource->slot;
+    uint8_t function = resource->function;
+    if (resource->bar != RESOURCE_WINDOW) {
+        int offset = bar_offset(bus, slot, function, resource->bar);
+        pci_cfg_write_dword(bus, slot, function, offset, (uint32_t) base);
+        if (resource->is64) {
+            pci_cfg_write_dword(bus, slot, function, offset + 4, (uint32_t) (base >> 32));
+        }
+        if (resource->bar < RESOURCE_VF) {
+            pci_control_set(bus, slot, function, decode_bit(resource));
+        }
+        return;
+    }
+    // Empty windows get a base above their limit, which closes them
+    if (!resource->size) {
+        base = resource->align;
+    }
+    uint64_t limit = base + resource->size - 1;
+    if (resource->kind == RESOURCE_IO) {
+        pci_cfg_write_byte(bus, slot, function, PCI_CFG_IO_BASE, (base >> 8) & 0xf0);
+        pci_cfg_write_byte(bus, slot, function, PCI_CFG_IO_LIMIT, (limit >> 8) & 0xf0);
+        pci_cfg_write_word(bus, slot, function, PCI_CFG_IO_BASE_HI, base >> 16);
+        pci_cfg_write_word(bus, slot, function, PCI_CFG_IO_LIMIT_HI, limit >> 16);
+    } else {
+        int offset = resource->kind == RESOURCE_MEM ? PCI_CFG_MEMORY_BASE : PCI_CFG_PREFETCH_BASE;
+        pci_cfg_write_word(bus, slot, function, offset, (base >> 16) & 0xfff0);
+        pci_cfg_write_word(bus, slot, function, offset + 2, (limit >> 16) & 0xfff0);
+        if (resource->kind == RESOURCE_PREF) {
+            pci_cfg_write_dword(bus, slot, function, PCI_CFG_PREFETCH_BASE_HI, base >> 32);
+            pci_cfg_write_dword(bus, slot, function, PCI_CFG_PREFETCH_LIMIT_HI, limit >> 32);
+        }
+    }
+    if (resource->size) {
+        pci_control_set(bus, slot, function, decode_bit(resource));
+    }
+    uint64_t end = base;
+    for (uint16_t i = resource->children; i != RESOURCE_NONE; i = resources[i].next) {
+        uint64_t child_base = align_up(end, resources[i].align);
+        assign_resource(&resources[i], child_base);
+        end = child_base + resources[i].size;
+    }
+    if (resource->kind != RESOURCE_IO && resource->size) {
+        mmio_wasted += resource->size - (end - base);
+    }
+}
+
+// Place a resource in the first root window of the chain with room left for it
+static int place_resource(struct pci_resource *resource, struct pci_bar_window *window) {
+    for (; window; window = window->next) {
+        uint64_t base = align_up(window->base, resource->align);
+        uint64_t end = base + resource->size;
+        if (end > window->limit || (!resource->is64 && end > 0x100000000)) {
+            continue;
+        }
+        if (resource->kind != RESOURCE_IO) {
+            mmio_assigned += end - window->base;
+            mmio_wasted += base - window->base;
+        }
+        window->base = end;
+        assign_resource(resource, base);
+        return 0;
+    }
+    return -1;
+}
+
+// Nothing behind a window that couldn't be placed may decode either: the window is closed, and all
+// the functions behind it stop decoding its kind of space. Returns how many resources are left out
+static int unassign_resource(struct pci_resource *resource) {
+    if (resource->bar < RESOURCE_VF || resource->bar == RESOURCE_WINDOW) {
+        pci_control_clear(resource->bus, resource->slot, resource->function, decode_bit(resource));
+    }
+    if (resource->bar != RESOURCE_WINDOW) {
+        return 1;
+    }
+    struct pci_resource closed = *resource;
+    closed.size = 0;
+    closed.children = RESOURCE_NONE;
+    assign_resource(&closed, 0);
+    int count = 1;
+    for (uint16_t i = resource->children; i != RESOURCE_NONE; i = resources[i].next) {
+        count += unassign_resource(&resources[i]);
+    }
+    return count;
+}
+
+static struct pci_bar_window *high_windows(struct pci_bar_window *window) {
+    while (window && !(window->orig_base >> 32)) {
+        window = window->next;
+    }
+    return window;
+}
+
+static void assign_root(uint16_t *list, struct pci_bar_window *window) {
+    static const char *kinds[3] = {"IO", "Memory", "Prefetchable"};
+    sort_resources(list);
+    for (uint16_t i = *list; i != RESOURCE_NONE; i = resources[i].next) {
+        struct pci_resource *resource = &resources[i];
+        // 64 bit prefetchable memory goes above 4 GB first, so that the space below is left to the rest
+        if (resource->kind == RESOURCE_PREF && resource->is64 && place_resource(resource, high_windows(window)) == 0) {
+            continue;
+        }
+        if (place_resource(resource, window) == 0) {
+            continue;
+        }
+        // Prefetchable memory can always fall back to the non prefetchable windows
+        if (resource->kind == RESOURCE_PREF && place_resource(resource, mem_bar_window) == 0) {
+            continue;
+        }
+        print("PCI: No %s space left for %X bytes of Bus %d Slot %d Function %d, leaving them unassigned",
+            kinds[resource->kind], resource->size, resource->bus, resource->slot, resource->function);
+        unassigned += unassign_resource(resource);
+    }
+}
+
+// A kind of space that a function has no BAR or window for can't overlap anything, and still has to
+// be decoded for the fixed legacy ranges of VGA, IDE and ISA bridges. The resources of a function
+// were added right after its inventory entry, both in enumeration order, so the two lists are
+// walked side by side
+static void decode_fixed_ranges() {
+    int r = 0;
+    for (int i = 0; i < inventory_count; i++) {
+        struct pci_function *entry = &inventory[i];
+        uint16_t bits = PCI_CFG_COMMAND_MEM_ENABLE | PCI_CFG_COMMAND_IO_ENABLE;
+        for (; r < resource_count && resources[r].bus == entry->bus && resources[r].slot == entry->slot
+            && resources[r].function == entry->function; r++) {
+            if (resources[r].bar < RESOURCE_VF || resources[r].bar == RESOURCE_WINDOW) {
+                bits &= ~decode_bit(&resources[r]);
+            }
+        }
+        if (bits) {
+            pci_control_set(entry->bus, entry->slot, entry->function, bits);
+        }
+    }
+}
+
+// How much of each root window ended up used, in the format the enumeration benchmark parses
+static void report_windows(const char *name, struct pci_bar_window *window) {
+    for (; window; window = window->next) {
+        print("PCI: %s window at %X: %X of %X bytes used", name, window->orig_base,
+            window->base - window->orig_base, window->limit - window->orig_base);
     }
-    return found_buses;
 }
 
 /* Globally visible functions */
@@ -264,34 +766,53 @@ int pci_exists() {
     return 1;
 }
 
-uint8_t pci_cfg_read_byte(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset) {
-    send_address(bus, slot, function, offset);
-    return inb(PCI_CFG_DATA + (offset & 3));
+// Switch all configuration space accesses to the ECAM window at base, which must be already
+// decoded by the chipset. Buses past the window keep going through the legacy ports
+int pci_ecam_enable(uint64_t base, int bus_count) {
+    if ((base >> 32) || bus_count <= 0 || bus_count > 256) {
+        print("PCI: Cannot use ECAM at %X for %d buses", base, bus_count);
+        return -1;
+    }
+    // Time a scan of bus 0 through both backends, as a reference of what is saved
+    uint64_t start = rdtsc();
+    scan_bus_vendors(0);
+    uint64_t port_cycles = rdtsc() - start;
+    ecam_base = base;
+    ecam_buses = bus_count;
+    start = rdtsc();
+    scan_bus_vendors(0);
+    uint64_t ecam_cycles = rdtsc() - start;
+    print("PCI: ECAM enabled at %x for %d buses", (uint32_t) base, bus_count);
+    print("PCI: Scanning bus 0 took %d cycles through ports, %d cycles through ECAM", (int) port_cycles, (int) ecam_cycles);
+    return 0;
 }
 
-uint16_t pci_cfg_read_word(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset) {
-    send_address(bus, slot, function, offset);
-    return inw(PCI_CFG_DATA + (offset & 2));
+int pci_ecam_enabled() {
+    return ecam_base != 0;
 }
 
-uint32_t pci_cfg_read_dword(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset) {
-    send_address(bus, slot, function, offset);
-    return ind(PCI_CFG_DATA);
+uint8_t pci_cfg_read_byte(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset) {
+    return (uint8_t) cfg_access(bus, slot, function, offset, 1, 0, 0);
 }
 
-void pci_cfg_write_byte(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset, uint8_t data) {
-    send_address(bus, slot, function, offset);
-    outb(PCI_CFG_DATA + (offset & 3), data);
+uint16_t pci_cfg_read_word(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset) {
+    return (uint16_t) cfg_access(bus, slot, function, offset, 2, 0, 0);
 }
 
-void pci_cfg_write_word(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset, uint16_t data) {
-    send_address(bus, slot, function, offset);
-    outw(PCI_CFG_DATA + (offset & 2), data);
+uint32_t pci_cfg_read_dword(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset) {
+    return cfg_access(bus, slot, function, offset, 4, 0, 0);
 }
 
-void pci_cfg_write_dword(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset, uint32_t data) {
-    send_address(bus, slot, function, offset);
-    outd(PCI_CFG_DATA, data);
+void pci_cfg_write_byte(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset, uint8_t data) {
+    cfg_access(bus, slot, function, offset, 1, 1, data);
+}
+
+void pci_cfg_write_word(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset, uint16_t data) {
+    cfg_access(bus, slot, function, offset, 2, 1, data);
+}
+
+void pci_cfg_write_dword(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset, uint32_t data) {
+    cfg_access(bus, slot, function, offset, 4, 1, data);
 }
 
 void pci_control_set(uint8_t bus, uint8_t slot, uint8_t function, uint16_t bits) {
@@ -302,6 +823,213 @@ void pci_control_clear(uint8_t bus, uint8_t slot, uint8_t function, uint16_t bit
     pci_cfg_write_word(bus, slot, function, PCI_CFG_COMMAND, pci_cfg_read_word(bus, slot, function, PCI_CFG_COMMAND) & ~bits);
 }
 
+// Returns the offset of the first capability with that ID after the one at after (0 to start from
+// the beginning), or 0 if there is none. The walk is bounded in case the list loops
+uint8_t pci_cap_find(uint8_t bus, uint8_t slot, uint8_t function, uint8_t id, uint8_t after) {
+    if (!(pci_cfg_read_word(bus, slot, function, PCI_CFG_STATUS) & PCI_CFG_STATUS_CAPABILITIES)) {
+        return 0;
+    }
+    uint8_t offset = after ? pci_cfg_read_byte(bus, slot, function, after + 1) : pci_cfg_read_byte(bus, slot, function, PCI_CFG_CAPABILITIES);
+    for (int i = 0; i < 48 && offset >= 0x40; i++) {
+        offset &= 0xfc;
+        if (pci_cfg_read_byte(bus, slot, function, offset) == id) {
+            return offset;
+        }
+        offset = pci_cfg_read_byte(bus, slot, function, offset + 1);
+    }
+    return 0;
+}
+
+// Same as above for extended capabilities, whose headers are a 16 bit ID, a version and a 12 bit next pointer
+uint16_t pci_ext_cap_find(uint8_t bus, uint8_t slot, uint8_t function, uint16_t id, uint16_t after) {
+    if (!ecam_base || bus >= ecam_buses || !pci_cap_find(bus, slot, function, PCI_CAP_PCIE, 0)) {
+        return 0;
+    }
+    uint16_t offset = after ? pci_cfg_read_dword(bus, slot, function, after) >> 20 : PCI_EXT_CAP_START;
+    for (int i = 0; i < (PCI_CFG_SPACE_EXT_SIZE - PCI_CFG_SPACE_SIZE) / 4 && offset >= PCI_CFG_SPACE_SIZE; i++) {
+        offset &= 0xffc;
+        uint32_t header = pci_cfg_read_dword(bus, slot, function, offset);
+        if (header == 0 || header == 0xffffffff) {
+            return 0;
+        }
+        if ((header & 0xffff) == id) {
+            return offset;
+        }
+        offset = header >> 20;
+    }
+    return 0;
+}
+
+static int payload_code(int bytes) {
+    int code = 0;
+    while ((256 << code) <= bytes && code < 5) {
+        code++;
+    }
+    return code;
+}
+
+int pci_pcie_payload_get(uint8_t bus, uint8_t slot, uint8_t function, int *mps, int *mrrs) {
+    uint8_t cap = pci_cap_find(bus, slot, function, PCI_CAP_PCIE, 0);
+    if (!cap) {
+        return -1;
+    }
+    uint16_t control = pci_cfg_read_word(bus, slot, function, cap + PCI_PCIE_DEVICE_CONTROL);
+    *mps = 128 << ((control >> PCI_PCIE_MPS_SHIFT) & 0x07);
+    *mrrs = 128 << ((control >> PCI_PCIE_MRRS_SHIFT) & 0x07);
+    return 0;
+}
+
+int pci_pcie_payload_set(uint8_t bus, uint8_t slot, uint8_t function, int mps, int mrrs) {
+    uint8_t cap = pci_cap_find(bus, slot, function, PCI_CAP_PCIE, 0);
+    if (!cap) {
+        return -1;
+    }
+    uint16_t control = pci_cfg_read_word(bus, slot, function, cap + PCI_PCIE_DEVICE_CONTROL);
+    control &= ~((0x07 << PCI_PCIE_MPS_SHIFT) | (0x07 << PCI_PCIE_MRRS_SHIFT));
+    control |= (payload_code(mps) << PCI_PCIE_MPS_SHIFT) | (payload_code(mrrs) << PCI_PCIE_MRRS_SHIFT);
+    pci_cfg_write_word(bus, slot, function, cap + PCI_PCIE_DEVICE_CONTROL, control);
+    return 0;
+}
+
+// Every function below a root port has to agree on the payload size, so each hierarchy gets the
+// smallest MPS any of its functions supports. Read requests are capped to the same size, so that
+// completions never exceed what the requester takes. The inventory is in depth first order, so a
+// hierarchy is an entry on bus 0 followed by everything up to the next one
+static void tune_pcie() {
+    for (int start = 0, end; start < inventory_count; start = end) {
+        end = start + 1;
+        while (end < inventory_count && inventory[end].bus != 0) {
+            end++;
+        }
+        int mps = 5;
+        int pcie = 0;
+        for (int i = start; i < end; i++) {
+            struct pci_function *entry = &inventory[i];
+            uint8_t cap = pci_cap_find(entry->bus, entry->slot, entry->function, PCI_CAP_PCIE, 0);
+            if (!cap) {
+                continue;
+            }
+            int supported = pci_cfg_read_dword(entry->bus, entry->slot, entry->function, cap + PCI_PCIE_DEVICE_CAP) & 0x07;
+            if (supported < mps) {
+                mps = supported;
+            }
+            pcie = 1;
+        }
+        for (int i = start; i < end; i++) {
+            struct pci_function *entry = &inventory[i];
+            if (pci_pcie_payload_set(entry->bus, entry->slot, entry->function, 128 << mps, 128 << mps) == 0 && entry->header == 0x00) {
+                // Endpoints don't need their DMA strictly ordered with each other
+                uint8_t cap = pci_cap_find(entry->bus, entry->slot, entry->function, PCI_CAP_PCIE, 0);
+                uint16_t control = pci_cfg_read_word(entry->bus, entry->slot, entry->function, cap + PCI_PCIE_DEVICE_CONTROL);
+                pci_cfg_write_word(entry->bus, entry->slot, entry->function, cap + PCI_PCIE_DEVICE_CONTROL, control | PCI_PCIE_DEVICE_CONTROL_RELAXED);
+            }
+        }
+        if (pcie && mps > 0) {
+            print("PCI: Hierarchy of Bus %d Slot %d Function %d uses %d byte payloads",
+                inventory[start].bus, inventory[start].slot, inventory[start].function, 128 << mps);
+        }
+    }
+}
+
+static int next_vector = PCI_MSI_VECTOR_BASE;
+
+// Hands out count (a power of 2) consecutive vectors, aligned to count as multiple message MSI needs
+int pci_vector_alloc(int count) {
+    int vector = (next_vector + (count - 1)) & ~(count - 1);
+    if (vector + count > PCI_MSI_VECTOR_LIMIT) {
+        print("PCI: Out of interrupt vectors, cannot allocate %d", count);
+        return -1;
+    }
+    next_vector = vector + count;
+    return vector;
+}
+
+// Gives back the vectors of the last pci_vector_alloc(), when they ended up unused
+void pci_vector_free(int vector, int count) {
+    if (vector + count == next_vector) {
+        next_vector = vector;
+    }
+}
+
+static uint32_t msi_address() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return PCI_MSI_ADDRESS | ((ebx >> 24) << 12);
+}
+
+// Programs MSI with up to count vectors starting at vector, and returns how many the function got
+int pci_msi_enable(uint8_t bus, uint8_t slot, uint8_t function, int vector, int count) {
+    uint8_t cap = pci_cap_find(bus, slot, function, PCI_CAP_MSI, 0);
+    if (!cap) {
+        return -1;
+    }
+    uint16_t control = pci_cfg_read_word(bus, slot, function, cap + PCI_MSI_CONTROL);
+    int log2 = 0;
+    while ((2 << log2) <= count && log2 < ((control >> 1) & 0x07)) {
+        log2++;
+    }
+    pci_cfg_write_dword(bus, slot, function, cap + PCI_MSI_ADDRESS_LOW, msi_address());
+    if (control & PCI_MSI_CONTROL_64) {
+        pci_cfg_write_dword(bus, slot, function, cap + PCI_MSI_ADDRESS_HIGH, 0);
+        pci_cfg_write_word(bus, slot, function, cap + PCI_MSI_DATA_64, vector);
+    } else {
+        pci_cfg_write_word(bus, slot, function, cap + PCI_MSI_DATA_32, vector);
+    }
+    control = (control & ~0x70) | (log2 << 4) | 1;
+    pci_cfg_write_word(bus, slot, function, cap + PCI_MSI_CONTROL, control);
+    pci_control_set(bus, slot, function, PCI_CFG_COMMAND_INT_DISABLE);
+    return 1 << log2;
+}
+
+// Maps the table and the PBA through the BARs in the inventory, and enables MSI-X with every entry masked
+int pci_msix_enable(uint8_t bus, uint8_t slot, uint8_t function, struct pci_msix *msix) {
+    uint8_t cap = pci_cap_find(bus, slot, function, PCI_CAP_MSIX, 0);
+    if (!cap) {
+        return -1;
+    }
+    uint32_t table = pci_cfg_read_dword(bus, slot, function, cap + PCI_MSIX_TABLE);
+    uint32_t pba = pci_cfg_read_dword(bus, slot, function, cap + PCI_MSIX_PBA);
+    // BIRs 6 and 7 are reserved
+    if ((table & 0x07) > 5 || (pba & 0x07) > 5) {
+        print("PCI: MSI-X of Bus %d Slot %d Function %d points to a reserved BAR", bus, slot, function);
+        return -1;
+    }
+    uint64_t table_bar = pci_get_bar(bus, slot, function, table & 0x07);
+    uint64_t pba_bar = pci_get_bar(bus, slot, function, pba & 0x07);
+    if (!table_bar || !pba_bar || (table_bar >> 32) || (pba_bar >> 32)) {
+        print("PCI: MSI-X table of Bus %d Slot %d Function %d isn't mapped below 4GB", bus, slot, function);
+        return -1;
+    }
+    msix->table = (volatile uint32_t *) (uintptr_t) (table_bar + (table & ~0x07));
+    msix->pba = (volatile uint32_t *) (uintptr_t) (pba_bar + (pba & ~0x07));
+    uint16_t control = pci_cfg_read_word(bus, slot, function, cap + PCI_MSIX_CONTROL);
+    msix->entries = (control & 0x7ff) + 1;
+    pci_cfg_write_word(bus, slot, function, cap + PCI_MSIX_CONTROL, control | PCI_MSIX_CONTROL_ENABLE | PCI_MSIX_CONTROL_MASK);
+    for (int i = 0; i < msix->entries; i++) {
+        msix->table[i * 4 + 3] = PCI_MSIX_ENTRY_MASKED;
+    }
+    pci_cfg_write_word(bus, slot, function, cap + PCI_MSIX_CONTROL, (control | PCI_MSIX_CONTROL_ENABLE) & ~PCI_MSIX_CONTROL_MASK);
+    pci_control_set(bus, slot, function, PCI_CFG_COMMAND_INT_DISABLE);
+    return msix->entries;
+}
+
+void pci_msix_set(struct pci_msix *msix, int entry, int vector, int masked) {
+    volatile uint32_t *table_entry = &msix->table[entry * 4];
+    table_entry[3] = PCI_MSIX_ENTRY_MASKED;
+    table_entry[0] = msi_address();
+    table_entry[1] = 0;
+    table_entry[2] = vector;
+    table_entry[3] = masked ? PCI_MSIX_ENTRY_MASKED : 0;
+}
+
+int pci_msix_pending(struct pci_msix *msix, int entry) {
+    return (msix->pba[entry / 32] >> (entry % 32)) & 1;
+}
+
+void pci_hotplug_padding_set(const struct pci_hotplug_padding *padding) {
+    hotplug_padding = *padding;
+}
+
 int pci_setup(struct pci_bar_window *mem_window, struct pci_bar_window *io_window, struct pci_bar_window *pref_window,  uint8_t (*get_interrupt_line_)(int pin, uint8_t bus, uint8_t slot, uint8_t function)) {
     if (!pci_exists()) {
         print("PCI: Not available");
@@ -311,79 +1039,149 @@ int pci_setup(struct pci_bar_window *mem_window, struct pci_bar_window *io_windo
     io_bar_window = io_window;
     pref_bar_window = pref_window;
     get_interrupt_line = get_interrupt_line_;
-    setup_bus(0);
+    resources = malloc(PCI_MAX_RESOURCES * sizeof(struct pci_resource), 8);
+    if (!resources) {
+        print("PCI: Cannot allocate the resource lists");
+        return -1;
+    }
+    uint32_t accesses = cfg_accesses;
+    uint64_t start = rdtsc();
+    inventory_count = 0;
+    last_bus = 0;
+    resource_count = 0;
+    struct pci_bar_window *pref_high = high_windows(pref_window);
+    rebar_room[0] = pref_window->limit - pref_window->base;
+    rebar_room[1] = pref_high ? pref_high->limit - pref_high->base : 0;
+    // First pass: number the buses and size everything
+    uint16_t root_lists[3] = {RESOURCE_NONE, RESOURCE_NONE, RESOURCE_NONE};
+    uint16_t *lists[3] = {&root_lists[RESOURCE_IO], &root_lists[RESOURCE_MEM], &root_lists[RESOURCE_PREF]};
+    setup_bus(0, lists, SCAN_ALL);
+    // Second pass: pack the biggest alignments first in each window
+    assign_root(lists[RESOURCE_IO], io_bar_window);
+    assign_root(lists[RESOURCE_MEM], mem_bar_window);
+    assign_root(lists[RESOURCE_PREF], pref_bar_window);
+    decode_fixed_ranges();
+    free(resources, PCI_MAX_RESOURCES * sizeof(struct pci_resource));
+    for (int i = 0; i < inventory_count; i++) {
+        inventory_finish(&inventory[i]);
+    }
+    inventory_index();
+    tune_pcie();
+    uint64_t cycles = rdtsc() - start;
+    print("PCI: Enumeration took %d kcycles and %d configuration space accesses through %s",
+        (int) (cycles / 1000), cfg_accesses - accesses, ecam_base ? "ECAM" : "ports");
+    print("PCI: %d resources, %d KB of MMIO assigned, %d KB of it lost to alignment",
+        resource_count, (int) (mmio_assigned >> 10), (int) (mmio_wasted >> 10));
+    print("PCI: %d functions on %d buses, %d resources unassigned", inventory_count, buses, unassigned);
+    if (buses > 256) {
+        print("PCI: Ran out of bus numbers, %d buses wanted", buses);
+    }
+    report_windows("IO", io_bar_window);
+    report_windows("Memory", mem_bar_window);
+    report_windows("Prefetchable", pref_bar_window);
     return 0;
 }
 
-uint64_t pci_get_bar(uint8_t bus, uint8_t slot, uint8_t function, int bar) {
-    uint32_t bar_val = pci_cfg_read_dword(bus, slot, function, PCI_CFG_BAR0 + (bar * 4));
-    if (bar_val & 1) {
-        // I/O bar
-        return (uint64_t) ((uint16_t) bar_val & ~0x03);
-    }
-    if (((bar_val >> 1) & 0x03) == 0) {
-        // 32-bit MMIO bar
-        return (uint64_t) (bar_val & ~0x0f);
+// Probes the size of an assigned BAR, with decoding off while the BAR holds all ones
+uint64_t pci_get_bar_size(uint8_t bus, uint8_t slot, uint8_t function, int bar) {
+    uint16_t command = pci_cfg_read_word(bus, slot, function, PCI_CFG_COMMAND);
+    pci_cfg_write_word(bus, slot, function, PCI_CFG_COMMAND, command & ~(PCI_CFG_COMMAND_MEM_ENABLE | PCI_CFG_COMMAND_IO_ENABLE));
+    int type;
+    uint64_t size = probe_bar(bus, slot, function, bar, &type);
+    pci_cfg_write_word(bus, slot, function, PCI_CFG_COMMAND, command);
+    return size;
+}
+
+// How much of an assigned BAR the CPU can reach, which stops at 4 GB
+size_t pci_get_bar_reachable(uint8_t bus, uint8_t slot, uint8_t function, int bar) {
+    uint64_t base = pci_get_bar(bus, slot, function, bar);
+    uint64_t size = pci_get_bar_size(bus, slot, function, bar);
+    if (!base || (base >> 32)) {
+        return 0;
     }
-    if (((bar_val >> 1) & 0x03) == 2) {
-        // 64-bit MMIO bar
-        return ((uint64_t) pci_cfg_read_dword(bus, slot, function, PCI_CFG_BAR0 + ((bar + 1) * 4)) << 32) | (bar_val & ~0x0f);
+    return base + size > 0x100000000 ? 0x100000000 - base : size;
+}
+
+uint64_t pci_get_bar(uint8_t bus, uint8_t slot, uint8_t function, int bar) {
+    struct pci_function *entry = pci_function_find(bus, slot, function);
+    if (entry) {
+        return entry->bars[bar];
     }
-    return 0;
+    return read_bar(bus, slot, function, bar);
+}
+
+static int device_matches(struct pci_function *found, struct pci_device *device) {
+    return (found->vendor == device->vendor || device->vendor == 0xffff)
+        && (found->device == device->device || device->device == 0xffff)
+        && (found->class == device->class || device->class == 0xff)
+        && (found->subclass == device->subclass || device->subclass == 0xff)
+        && (found->interface == device->interface || device->interface == 0xff)
+        && (found->subsystem_vendor == device->subsystem_vendor || device->subsystem_vendor == 0xffff)
+        && (found->subsystem_device == device->subsystem_device || device->subsystem_device == 0xffff);
 }
 
-static int find_device_in_bus(struct pci_device *device, uint8_t bus, uint8_t *bus_ptr, uint8_t *slot_ptr, uint8_t *function_ptr, int *occurence, int index) {
-    for (uint8_t slot = 0; slot < 32; slot++) {
-        if (pci_cfg_read_word(bus, slot, 0, PCI_CFG_VENDOR) == 0xffff) {
+int pci_device_get(struct pci_device *device, uint8_t *bus_ptr, uint8_t *slot_ptr, uint8_t *function_ptr, int index) {
+    // Walk the smallest list that can contain the device: its class chain, its vendor chain, or everything
+    int by_class = device->class != 0xff;
+    int by_vendor = !by_class && device->vendor != 0xffff;
+    int i = by_class ? class_head[class_bucket(device->class)] : by_vendor ? vendor_head[vendor_bucket(device->vendor)] : 0;
+    int occurrence = 0;
+    for (; i < inventory_count; i = by_class ? class_next[i] : by_vendor ? vendor_next[i] : i + 1) {
+        struct pci_function *found = &inventory[i];
+        if (found->header != 0x00 || !device_matches(found, device)) {
             continue;
         }
-        uint8_t functions = pci_cfg_read_byte(bus, slot, 0, PCI_CFG_HEADER) & PCI_CFG_HEADER_MULTIFUNCTION ? 8 : 1;
-        for (uint8_t function = 0; function < functions; function++) {
-            if (pci_cfg_read_word(bus, slot, function, PCI_CFG_VENDOR) == 0xffff) {
-                continue;
-            }
-            uint8_t type = pci_cfg_read_byte(bus, slot, function, PCI_CFG_HEADER) & ~PCI_CFG_HEADER_MULTIFUNCTION;
-            if (type == 0x00) {
-                struct pci_device found_device;
-                found_device.vendor = pci_cfg_read_word(bus, slot, function, PCI_CFG_VENDOR);
-                found_device.device = pci_cfg_read_word(bus, slot, function, PCI_CFG_DEVICE);
-                found_device.class = pci_cfg_read_byte(bus, slot, function, PCI_CFG_CLASS);
-                found_device.subclass = pci_cfg_read_byte(bus, slot, function, PCI_CFG_SUBCLASS);
-                found_device.interface = pci_cfg_read_byte(bus, slot, function, PCI_CFG_INTERFACE);
-                found_device.subsystem_vendor = pci_cfg_read_word(bus, slot, function, PCI_CFG_SUBSYSTEM_VENDOR);
-                found_device.subsystem_device = pci_cfg_read_word(bus, slot, function, PCI_CFG_SUBSYSTEM_DEVICE);
-                if (found_device.vendor == device->vendor || device->vendor == 0xffff) {
-                    if (found_device.device == device->device || device->device == 0xffff) {
-                        if (found_device.class == device->class || device->class == 0xff) {
-                            if (found_device.subclass == device->subclass || device->subclass == 0xff) {
-                                if (found_device.interface == device->interface || device->interface == 0xff) {
-                                    if (found_device.subsystem_vendor == device->subsystem_vendor || device->subsystem_vendor == 0xffff) {
-                                        if (found_device.subsystem_device == device->subsystem_device || device->subsystem_device == 0xffff) {
-                                            if (*occurence == index) {
-                                                *bus_ptr = bus;
-                                                *slot_ptr = slot;
-                                                *function_ptr = function;
-                                                return 0;
-                                            }
-                                            *occurence = *occurence + 1;
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            } else if (type == 0x01) {
-                if (find_device_in_bus(device, pci_cfg_read_byte(bus, slot, function, PCI_CFG_SECONDARY_BUS), bus_ptr, slot_ptr, function_ptr, occurence, index) == 0) {
-                    return 0;
-                }
-            }
+        if (occurrence++ == index) {
+            *bus_ptr = found->bus;
+            *slot_ptr = found->slot;
+            *function_ptr = found->function;
+            return 0;
         }
     }
     return -1;
 }
 
-int pci_device_get(struct pci_device *device, uint8_t *bus_ptr, uint8_t *slot_ptr, uint8_t *function_ptr, int index) {
-    int occurrence = 0;
-    return find_device_in_bus(device, 0, bus_ptr, slot_ptr, function_ptr, &occurrence, index);
+void pci_inventory_get(struct pci_inventory *inventory_) {
+    inventory_->functions = inventory;
+    inventory_->count = &inventory_count;
+    inventory_->last_bus = &last_bus;
+    inventory_->class_head = class_head;
+    inventory_->class_next = class_next;
+    inventory_->vendor_head = vendor_head;
+    inventory_->vendor_next = vendor_next;
+}
+
+int pci_function_count() {
+    return inventory_count;
+}
+
+struct pci_function *pci_function_get(int index) {
+    if (index < 0 || index >= inventory_count) {
+        return NULL;
+    }
+    return &inventory[index];
+}
+
+struct pci_function *pci_function_find(uint8_t bus, uint8_t slot, uint8_t function) {
+    for (int i = 0; i < inventory_count; i++) {
+        if (inventory[i].bus == bus && inventory[i].slot == slot && inventory[i].function == function) {
+            return &inventory[i];
+        }
+    }
+    return NULL;
+}
+
+// Rebuild the inventory from what is in configuration space right now, without assigning
+// any resources. Used after devices have been hot added or removed
+int pci_rescan() {
+    inventory_count = 0;
+    last_bus = 0;
+    rescanning = 1;
+    setup_bus(0, NULL, SCAN_ALL);
+    rescanning = 0;
+    for (int i = 0; i < inventory_count; i++) {
+        inventory_finish(&inventory[i]);
+    }
+    inventory_index();
+    return inventory_count;
 }
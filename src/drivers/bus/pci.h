@@ -7,9 +7,13 @@
 #define PCI_CFG_ADDRESS 0xcf8
 #define PCI_CFG_DATA    0xcfc
 
+#define PCI_CFG_SPACE_SIZE     0x100
+#define PCI_CFG_SPACE_EXT_SIZE 0x1000
+
 #define PCI_CFG_VENDOR           0x00
 #define PCI_CFG_DEVICE           0x02
 #define PCI_CFG_COMMAND          0x04
+#define PCI_CFG_STATUS           0x06
 #define PCI_CFG_INTERFACE        0x09
 #define PCI_CFG_SUBCLASS         0x0a
 #define PCI_CFG_CLASS            0x0b
@@ -18,6 +22,7 @@
 #define PCI_CFG_SUBSYSTEM_VENDOR 0x2c
 #define PCI_CFG_SUBSYSTEM_DEVICE 0x2e
 #define PCI_CFG_EXPANSION_ROM    0x30
+#define PCI_CFG_CAPABILITIES     0x34
 #define PCI_CFG_INTERRUPT_LINE   0x3c
 #define PCI_CFG_INTERRUPT_PIN    0x3d
 
@@ -41,8 +46,16 @@
 #define PCI_CFG_COMMAND_BUS_MASTER  (1 << 2)
 #define PCI_CFG_COMMAND_INT_DISABLE (1 << 10)
 
+#define PCI_CFG_STATUS_CAPABILITIES (1 << 4)
+
+#define PCI_ROM_ADDRESS_MASK 0xfffff800
+#define PCI_ROM_ENABLE       (1 << 0)
+
 #define PCI_CFG_HEADER_MULTIFUNCTION (1 << 7)
 
+// Low nibble of the prefetchable base and limit of bridges
+#define PCI_PREFETCH_64 0x01
+
 #define PCI_BAR_MEM_32  0x00
 #define PCI_BAR_IO      0x01
 #define PCI_BAR_MEM_64  0x02
@@ -57,20 +70,129 @@ struct pci_bar_window {
 };
 
 int pci_exists();
+int pci_ecam_enable(uint64_t base, int buses);
+int pci_ecam_enabled();
 
-uint8_t pci_cfg_read_byte(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset);
-uint16_t pci_cfg_read_word(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset);
-uint32_t pci_cfg_read_dword(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset);
+uint8_t pci_cfg_read_byte(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset);
+uint16_t pci_cfg_read_word(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset);
+uint32_t pci_cfg_read_dword(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset);
 
-void pci_cfg_write_byte(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset, uint8_t data);
-void pci_cfg_write_word(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset, uint16_t data);
-void pci_cfg_write_dword(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset, uint32_t data);
+void pci_cfg_write_byte(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset, uint8_t data);
+void pci_cfg_write_word(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset, uint16_t data);
+void pci_cfg_write_dword(uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset, uint32_t data);
 
 void pci_control_set(uint8_t bus, uint8_t slot, uint8_t function, uint16_t bits);
 void pci_control_clear(uint8_t bus, uint8_t slot, uint8_t function, uint16_t bits);
 
+// What hotplug capable ports get at least, whether something is behind them at boot or not,
+// so that devices added later fit without moving anything. Buses count the secondary one
+#define PCI_HOTPLUG_BUSES 1
+#define PCI_HOTPLUG_IO    0
+#define PCI_HOTPLUG_MEM   0x200000
+#define PCI_HOTPLUG_PREF  0x200000
+
+struct pci_hotplug_padding {
+    int buses;
+    uint64_t io;
+    uint64_t mem;
+    uint64_t pref;
+};
+
+void pci_hotplug_padding_set(const struct pci_hotplug_padding *padding);
 int pci_setup(struct pci_bar_window *mem_window, struct pci_bar_window *io_window, struct pci_bar_window *pref_window, uint8_t (*get_interrupt_line_)(int pirq, uint8_t bus, uint8_t slot, uint8_t function));
 uint64_t pci_get_bar(uint8_t bus, uint8_t slot, uint8_t function, int bar);
+uint64_t pci_get_bar_size(uint8_t bus, uint8_t slot, uint8_t function, int bar);
+size_t pci_get_bar_reachable(uint8_t bus, uint8_t slot, uint8_t function, int bar);
+
+// Capabilities. Extended ones live past the first 256 bytes and can only be reached with ECAM
+#define PCI_CAP_PM   0x01
+#define PCI_CAP_MSI  0x05
+#define PCI_CAP_PCIE 0x10
+#define PCI_CAP_MSIX 0x11
+
+// PCI Express capability, payload sizes are encoded as 128 << n
+#define PCI_PCIE_CAPS                   0x02
+#define PCI_PCIE_DEVICE_CAP             0x04
+#define PCI_PCIE_DEVICE_CONTROL         0x08
+#define PCI_PCIE_DEVICE_CONTROL_RELAXED (1 << 4)
+#define PCI_PCIE_MPS_SHIFT              5
+#define PCI_PCIE_MRRS_SHIFT             12
+#define PCI_PCIE_LINK_CAP               0x0c
+#define PCI_PCIE_LINK_STATUS            0x12
+#define PCI_PCIE_SLOT_CAP               0x14
+#define PCI_PCIE_SLOT_STATUS            0x1a
+#define PCI_PCIE_DEVICE_CAP2            0x24
+#define PCI_PCIE_DEVICE_CONTROL2        0x28
+
+#define PCI_PCIE_CAPS_TYPE(caps)       (((caps) >> 4) & 0x0f)
+#define PCI_PCIE_CAPS_SLOT             (1 << 8)
+#define PCI_PCIE_TYPE_ROOT_PORT        0x04
+#define PCI_PCIE_TYPE_DOWNSTREAM       0x06
+#define PCI_PCIE_LINK_CAP_DLL_REPORT   (1 << 20)
+#define PCI_PCIE_LINK_STATUS_DLL       (1 << 13)
+#define PCI_PCIE_SLOT_CAP_HOTPLUG      (1 << 6)
+#define PCI_PCIE_SLOT_STATUS_PRESENCE  (1 << 6)
+#define PCI_PCIE_DEVICE_CAP2_ARI       (1 << 5)
+#define PCI_PCIE_DEVICE_CONTROL2_ARI   (1 << 5)
+
+int pci_pcie_payload_get(uint8_t bus, uint8_t slot, uint8_t function, int *mps, int *mrrs);
+int pci_pcie_payload_set(uint8_t bus, uint8_t slot, uint8_t function, int mps, int mrrs);
+
+#define PCI_EXT_CAP_START 0x100
+#define PCI_EXT_CAP_ARI   0x000e
+#define PCI_EXT_CAP_SRIOV 0x0010
+#define PCI_EXT_CAP_REBAR 0x0015
+
+// Single Root I/O Virtualization. Each VF BAR is the BAR of the first VF, the others follow it back to back
+#define PCI_SRIOV_CONTROL   0x08
+#define PCI_SRIOV_TOTAL_VFS 0x0e
+#define PCI_SRIOV_NUM_VFS   0x10
+#define PCI_SRIOV_BAR0      0x24
+
+// Alternative Routing-ID: the function number takes all 8 bits, and the functions are chained
+#define PCI_ARI_CAPABILITY 0x04
+#define PCI_ARI_NEXT(cap)  (((cap) >> 8) & 0xff)
+
+#define PCI_REBAR_CAPABILITY 0x04
+#define PCI_REBAR_CONTROL    0x08
+#define PCI_REBAR_MAX_ORDER  10 // Resizable BARs are grown up to 1 GB (1 MB << 10), the OS can go further
+
+uint8_t pci_cap_find(uint8_t bus, uint8_t slot, uint8_t function, uint8_t id, uint8_t after);
+uint16_t pci_ext_cap_find(uint8_t bus, uint8_t slot, uint8_t function, uint16_t id, uint16_t after);
+
+// MSI and MSI-X. Messages are sent to the local APIC of the bootstrap processor, with vectors
+// handed out from a range that doesn't overlap the one the PICs are remapped to
+#define PCI_MSI_ADDRESS      0xfee00000
+#define PCI_MSI_VECTOR_BASE  0x80
+#define PCI_MSI_VECTOR_LIMIT 0xf0
+
+#define PCI_MSI_CONTROL       0x02
+#define PCI_MSI_CONTROL_64    (1 << 7)
+#define PCI_MSI_CONTROL_MASK  (1 << 8)
+#define PCI_MSI_ADDRESS_LOW   0x04
+#define PCI_MSI_ADDRESS_HIGH  0x08
+#define PCI_MSI_DATA_32       0x08
+#define PCI_MSI_DATA_64       0x0c
+
+#define PCI_MSIX_CONTROL          0x02
+#define PCI_MSIX_CONTROL_MASK     (1 << 14)
+#define PCI_MSIX_CONTROL_ENABLE   (1 << 15)
+#define PCI_MSIX_TABLE            0x04
+#define PCI_MSIX_PBA              0x08
+#define PCI_MSIX_ENTRY_MASKED     (1 << 0)
+
+struct pci_msix {
+    volatile uint32_t *table;
+    volatile uint32_t *pba;
+    int entries;
+};
+
+int pci_vector_alloc(int count);
+void pci_vector_free(int vector, int count);
+int pci_msi_enable(uint8_t bus, uint8_t slot, uint8_t function, int vector, int count);
+int pci_msix_enable(uint8_t bus, uint8_t slot, uint8_t function, struct pci_msix *msix);
+void pci_msix_set(struct pci_msix *msix, int entry, int vector, int masked);
+int pci_msix_pending(struct pci_msix *msix, int entry);
 
 struct pci_device {
     uint16_t vendor;
@@ -84,4 +206,45 @@ struct pci_device {
 
 int pci_device_get(struct pci_device *device, uint8_t *bus_ptr, uint8_t *slot_ptr, uint8_t *function_ptr, int index);
 
+// Inventory of every function found while enumerating, so that lookups don't need configuration cycles
+#define PCI_MAX_FUNCTIONS 256
+
+struct pci_function {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t function;
+    uint8_t header;
+    uint16_t vendor;
+    uint16_t device;
+    uint16_t subsystem_vendor;
+    uint16_t subsystem_device;
+    uint8_t class;
+    uint8_t subclass;
+    uint8_t interface;
+    uint8_t interrupt_line;
+    uint64_t bars[6];
+};
+
+// The class and vendor chains of the inventory, each one ends with an index past the count
+#define PCI_CLASS_BUCKETS          32
+#define PCI_VENDOR_BUCKETS         16
+#define PCI_CLASS_BUCKET(class)    ((class) % PCI_CLASS_BUCKETS)
+#define PCI_VENDOR_BUCKET(vendor)  (((vendor) ^ ((vendor) >> 8)) % PCI_VENDOR_BUCKETS)
+
+struct pci_inventory {
+    struct pci_function *functions;
+    int *count;
+    int *last_bus; // Highest subordinate bus of any bridge, empty and reserved buses included
+    uint16_t *class_head;
+    uint16_t *class_next;
+    uint16_t *vendor_head;
+    uint16_t *vendor_next;
+};
+
+void pci_inventory_get(struct pci_inventory *inventory);
+int pci_function_count();
+struct pci_function *pci_function_get(int index);
+struct pci_function *pci_function_find(uint8_t bus, uint8_t slot, uint8_t function);
+int pci_rescan();
+
 #endif
@@ -0,0 +1,119 @@
+#include <drivers/bus/pci.h>
+#include <drivers/bus/pci_rom.h>
+#include <tools/print.h>
+#include <tools/string.h>
+
+static uintptr_t shadow_next;
+static int shadowed;
+
+static uint32_t checksum(const volatile uint32_t *data, uint32_t length) {
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < length / 4; i++) {
+        sum = (sum << 5) + sum + data[i];
+    }
+    return sum;
+}
+
+// Walks the images of the ROM until the x86 one. Any broken header ends the walk
+static volatile struct pci_rom_header *find_image(uintptr_t rom, uint32_t rom_size, struct pci_function *entry) {
+    uint32_t offset = 0;
+    while (offset + sizeof(struct pci_rom_header) <= rom_size) {
+        volatile struct pci_rom_header *header = (volatile struct pci_rom_header *) (rom + offset);
+        if (header->signature != PCI_ROM_SIGNATURE || offset + header->pcir + sizeof(struct pci_rom_pcir) > rom_size) {
+            return NULL;
+        }
+        volatile struct pci_rom_pcir *pcir = (volatile struct pci_rom_pcir *) (rom + offset + header->pcir);
+        if (pcir->signature[0] != 'P' || pcir->signature[1] != 'C' || pcir->signature[2] != 'I' || pcir->signature[3] != 'R'
+            || pcir->vendor != entry->vendor || pcir->device != entry->device) {
+            return NULL;
+        }
+        if (pcir->code_type == PCI_ROM_CODE_X86) {
+            return header;
+        }
+        if ((pcir->indicator & PCI_ROM_LAST) || !pcir->image_length) {
+            return NULL;
+        }
+        offset += pcir->image_length * 512;
+    }
+    return NULL;
+}
+
+static void shadow_function(struct pci_function *entry, struct pci_rom_cache *cache) {
+    uint8_t bus = entry->bus;
+    uint8_t slot = entry->slot;
+    uint8_t function = entry->function;
+    uint32_t rom = pci_cfg_read_dword(bus, slot, function, PCI_CFG_EXPANSION_ROM) & PCI_ROM_ADDRESS_MASK;
+    if (!rom) {
+        return;
+    }
+    pci_cfg_write_dword(bus, slot, function, PCI_CFG_EXPANSION_ROM, PCI_ROM_ADDRESS_MASK);
+    uint32_t rom_size = ~(pci_cfg_read_dword(bus, slot, function, PCI_CFG_EXPANSION_ROM) & PCI_ROM_ADDRESS_MASK) + 1;
+    pci_cfg_write_dword(bus, slot, function, PCI_CFG_EXPANSION_ROM, rom | PCI_ROM_ENABLE);
+    volatile struct pci_rom_header *image = find_image(rom, rom_size, entry);
+    uintptr_t start = (uintptr_t) image;
+    uint32_t length = image ? image->size * 512 : 0;
+    if (!length || start + length > rom + rom_size) {
+        print("PCI: Bus %d Slot %d Function %d has no valid x86 option ROM", bus, slot, function);
+        goto done;
+    }
+    if (shadow_next + length > PCI_ROM_SHADOW_END) {
+        print("PCI: No shadow space left for the option ROM of Bus %d Slot %d Function %d", bus, slot, function);
+        goto done;
+    }
+    // Reading the ROM is needed to checksum it anyway, but writing the shadow copy can be skipped
+    // when it's still there from the last boot
+    uint32_t sum = checksum((const volatile uint32_t *) start, length);
+    int cached = shadowed < PCI_ROM_CACHE_ENTRIES;
+    if (cached && cache->entries[shadowed].vendor == entry->vendor && cache->entries[shadowed].device == entry->device
+        && cache->entries[shadowed].shadow == shadow_next && cache->entries[shadowed].length == length
+        && cache->entries[shadowed].checksum == sum && checksum((const uint32_t *) shadow_next, length) == sum) {
+        print("PCI: Option ROM of Bus %d Slot %d Function %d is unchanged at %x", bus, slot, function, shadow_next);
+    } else {
+        memcpy((void *) shadow_next, (const void *) start, length);
+        uint8_t byte_sum = 0;
+        for (uint32_t i = 0; i < length; i++) {
+            byte_sum += *((uint8_t *) shadow_next + i);
+        }
+        if (byte_sum) {
+            print("PCI: Option ROM of Bus %d Slot %d Function %d has a bad checksum", bus, slot, function);
+            goto done;
+        }
+        if (cached) {
+            cache->entries[shadowed].vendor = entry->vendor;
+            cache->entries[shadowed].device = entry->device;
+            cache->entries[shadowed].shadow = shadow_next;
+            cache->entries[shadowed].length = length;
+            cache->entries[shadowed].checksum = sum;
+        }
+        print("PCI: Option ROM of Bus %d Slot %d Function %d shadowed at %x, %d bytes", bus, slot, function, shadow_next, length);
+    }
+    shadow_next = (shadow_next + length + (PCI_ROM_ALIGN - 1)) & ~(PCI_ROM_ALIGN - 1);
+    shadowed++;
+done:
+    pci_cfg_write_dword(bus, slot, function, PCI_CFG_EXPANSION_ROM, rom);
+}
+
+// Copies the x86 image of every expansion ROM to the shadow region, which pam_unlock opens for writing
+int pci_rom_shadow(void (*pam_unlock)(int pam)) {
+    for (int pam = 1; pam <= 4; pam++) {
+        pam_unlock(pam);
+    }
+    struct pci_rom_cache *cache = (struct pci_rom_cache *) PCI_ROM_CACHE;
+    if (cache->magic != PCI_ROM_CACHE_MAGIC) {
+        memset(cache, 0, sizeof(struct pci_rom_cache));
+        cache->magic = PCI_ROM_CACHE_MAGIC;
+    }
+    shadow_next = PCI_ROM_SHADOW_START;
+    shadowed = 0;
+    // Displays go first, so that the first one gets 0xc0000 like a VGA BIOS needs
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < pci_function_count(); i++) {
+            struct pci_function *entry = pci_function_get(i);
+            if (entry->header == 0x00 && (entry->class == 0x03) == (pass == 0)) {
+                shadow_function(entry, cache);
+            }
+        }
+    }
+    print("PCI: %d option ROMs shadowed, %d KB of shadow space used", shadowed, (int) (shadow_next - PCI_ROM_SHADOW_START) / 1024);
+    return shadowed;
+}
@@ -0,0 +1,59 @@
+#ifndef __DRIVERS_BUS_PCI_ROM_H__
+#define __DRIVERS_BUS_PCI_ROM_H__
+
+#include <stdint.h>
+
+// Option ROMs are copied to the shadow region, 2KB aligned, with the one of the first display at 0xc0000.
+// The last 2KB hold a cache that survives resets, so that unchanged ROMs are not copied again
+// They aren't run: POST never goes back to real mode, so there is nothing to call their entry point with
+#define PCI_ROM_SHADOW_START 0xc0000
+#define PCI_ROM_SHADOW_END   0xdf800
+#define PCI_ROM_CACHE        0xdf800
+#define PCI_ROM_ALIGN        0x800
+
+#define PCI_ROM_SIGNATURE 0xaa55
+#define PCI_ROM_CODE_X86  0x00
+#define PCI_ROM_LAST      (1 << 7)
+
+struct pci_rom_header {
+    uint16_t signature;
+    uint8_t size; // In 512 byte units
+    uint8_t entry[3];
+    uint8_t reserved[0x12];
+    uint16_t pcir;
+} __attribute__((__packed__));
+
+struct pci_rom_pcir {
+    char signature[4];
+    uint16_t vendor;
+    uint16_t device;
+    uint16_t device_list;
+    uint16_t length;
+    uint8_t revision;
+    uint8_t class[3];
+    uint16_t image_length; // In 512 byte units
+    uint16_t code_revision;
+    uint8_t code_type;
+    uint8_t indicator;
+    uint16_t max_runtime_length;
+    uint16_t config_entry;
+    uint16_t dmtf_entry;
+} __attribute__((__packed__));
+
+#define PCI_ROM_CACHE_MAGIC   0x4d4f5243 // "CROM"
+#define PCI_ROM_CACHE_ENTRIES 32
+
+struct pci_rom_cache {
+    uint32_t magic;
+    struct {
+        uint16_t vendor;
+        uint16_t device;
+        uint32_t shadow;
+        uint32_t length;
+        uint32_t checksum;
+    } entries[PCI_ROM_CACHE_ENTRIES];
+};
+
+int pci_rom_shadow(void (*pam_unlock)(int pam));
+
+#endif
@@ -0,0 +1,41 @@
+#include <cpu/idt.h>
+#include <drivers/irqs/lapic.h>
+
+void lapic_spurious();
+void lapic_timer();
+
+// The timer only wakes the CPU up, its EOI goes straight to LAPIC_BASE + LAPIC_EOI
+__asm__(
+    ".pushsection .text\n"
+    "lapic_spurious:\n"
+    "    iret\n"
+    "lapic_timer:\n"
+    "    movl $0, 0xfee000b0\n"
+    "    iret\n"
+    ".popsection\n"
+);
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t *) (LAPIC_BASE + reg) = value;
+}
+
+// Enables the local APIC of the bootstrap processor for MSI, with the PICs still coming in
+// through LINT0 (virtual wire mode)
+void lapic_init() {
+    idt_set(LAPIC_SPURIOUS_VECTOR, lapic_spurious);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_EXTINT);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    idt_set(LAPIC_TIMER_VECTOR, lapic_timer);
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_1);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR); // One-shot
+}
+
+void lapic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// One-shot, in bus clock ticks, so that a halt can't last forever. 0 stops it
+void lapic_timer_start(uint32_t ticks) {
+    lapic_write(LAPIC_TIMER_INITIAL, ticks);
+}
@@ -0,0 +1,26 @@
+#ifndef __DRIVERS_IRQS_LAPIC_H__
+#define __DRIVERS_IRQS_LAPIC_H__
+
+#include <stdint.h>
+
+#define LAPIC_BASE 0xfee00000
+#define LAPIC_EOI 0xb0
+#define LAPIC_SVR 0xf0
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_DIVIDE 0x3e0
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_SPURIOUS_VECTOR 0xff
+#define LAPIC_TIMER_VECTOR 0xfe
+#define LAPIC_TIMER_DIVIDE_1 0x0b
+#define LAPIC_LVT_NMI (4 << 8)
+#define LAPIC_LVT_EXTINT (7 << 8)
+
+void lapic_init();
+void lapic_eoi();
+void lapic_timer_start(uint32_t ticks);
+
+#endif
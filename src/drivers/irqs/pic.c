@@ -2,7 +2,11 @@
 #include <drivers/irqs/pic.h>
 #include <tools/print.h>
 
+static uint8_t bases[2];
+
 void pic_init(uint8_t master_base, uint8_t slave_base) {
+    bases[0] = master_base;
+    bases[1] = slave_base;
     // (ICW1) Tell master and slave PIC what we're initializing them
     outb(PIC_MASTER_CMD, PIC_ICW1_INIT);
     outb(PIC_SLAVE_CMD, PIC_ICW1_INIT);
@@ -28,6 +32,8 @@ void pic_enable_irq(uint8_t irq) {
     if (irq > 7) {
         irq -= 8;
         outb(PIC_SLAVE_DATA, inb(PIC_SLAVE_DATA) & ~(1 << irq));
+        // The slave only gets through the cascade
+        outb(PIC_MASTER_DATA, inb(PIC_MASTER_DATA) & ~(1 << PIC_CASCADE_IRQ));
     } else {
         outb(PIC_MASTER_DATA, inb(PIC_MASTER_DATA) & ~(1 << irq));
     }
@@ -71,3 +77,15 @@ void pic_set_edge(uint8_t irq) {
         outb(PIC_MASTER_ELCR, inb(PIC_MASTER_ELCR) & ~(1 << irq));
     }
 }
+
+// Vector the IRQ arrives at, with the bases pic_init() was given
+int pic_vector(uint8_t irq) {
+    return bases[irq > 7] + (irq & 7);
+}
+
+void pic_eoi(uint8_t irq) {
+    if (irq > 7) {
+        outb(PIC_SLAVE_CMD, PIC_OCW2_EOI);
+    }
+    outb(PIC_MASTER_CMD, PIC_OCW2_EOI);
+}
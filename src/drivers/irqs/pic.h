@@ -12,11 +12,15 @@
 
 #define PIC_ICW1_INIT ((1 << 4) | (1 << 0))
 #define PIC_ICW4_8086 (1 << 0)
+#define PIC_OCW2_EOI (1 << 5)
+#define PIC_CASCADE_IRQ 2
 
 void pic_init(uint8_t master_base, uint8_t slave_base);
 void pic_enable_irq(uint8_t irq);
 void pic_disable_irq(uint8_t irq);
 void pic_set_level(uint8_t irq);
 void pic_set_edge(uint8_t irq);
+int pic_vector(uint8_t irq);
+void pic_eoi(uint8_t irq);
 
 #endif
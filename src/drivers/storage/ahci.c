@@ -1,17 +1,27 @@
+#include <cpu/idt.h>
 #include <cpu/misc.h>
 #include <cpu/pio.h>
 #include <drivers/bus/pci.h>
+#include <drivers/irqs/lapic.h>
+#include <drivers/irqs/pic.h>
 #include <drivers/storage/ahci.h>
 #include <drivers/storage/ata_common.h>
 #include <hal/disk.h>
 #include <tools/alloc.h>
 #include <tools/print.h>
+#include <tools/scratch.h>
 #include <tools/string.h>
+#include <tools/wait.h>
 
 static int s64a_supported(volatile struct ahci_abar *abar) {
     return abar->ghc.hba_capabilities & AHCI_CAP_64;
 }
 
+// DMA addresses are split in two halves, and the upper one is reserved without 64 bit addressing
+static int dma_addressable(volatile struct ahci_abar *abar, uint64_t addr) {
+    return s64a_supported(abar) || !(addr >> 32);
+}
+
 static int sss_supported(volatile struct ahci_abar *abar) {
     return abar->ghc.hba_capabilities & AHCI_CAP_SSS;
 }
@@ -28,34 +38,210 @@ static int port_implemented(volatile struct ahci_abar *abar, int port) {
     return abar->ghc.ports & (1 << port);
 }
 
-static int get_free_slot(volatile struct ahci_abar *abar, int index) {
-    uint32_t slots = abar->ports[index].sata_active | abar->ports[index].command_issue;
+// Controllers with an interrupt, through MSI or their INTx line. It only wakes the CPU up:
+// the handler masks the HBA and leaves the status to whoever waits on it. An INTx line can be
+// shared with devices that keep it asserted, so the handler masks it in the PIC too, and it's only
+// unmasked right before a port halts. Such a line ends every halt right away, which degrades the
+// wait to polling rather than running the handler forever
+static volatile struct ahci_abar *irq_abars[AHCI_IRQ_CONTROLLERS];
+static uint8_t irq_lines[AHCI_IRQ_CONTROLLERS]; // 0 with MSI
+static int irq_count;
+#ifdef BENCH
+static int irq_polled; // Set to compare against spinning
+static uint32_t irq_waits; // Halts or spins, whichever waiting took
+static uint64_t bench_sectors[32]; // Of the ports of the controller being brought up
+#endif
+
+void ahci_irq(int pic);
+
+__asm__(
+    ".pushsection .text\n"
+    "ahci_irq_msi:\n"
+    "    pushal\n"
+    "    pushl $0\n"
+    "    jmp 1f\n"
+    "ahci_irq_pic:\n"
+    "    pushal\n"
+    "    pushl $1\n"
+    "1:\n"
+    "    cld\n"
+    "    call ahci_irq\n"
+    "    addl $4, %esp\n"
+    "    popal\n"
+    "    iret\n"
+    ".popsection\n"
+);
+
+void ahci_irq_msi();
+void ahci_irq_pic();
+
+void ahci_irq(int pic) {
+    for (int i = 0; i < irq_count; i++) {
+        irq_abars[i]->ghc.global_hba_control &= ~AHCI_GHC_CNT_IE;
+        if (pic && irq_lines[i]) {
+            pic_disable_irq(irq_lines[i]);
+        }
+    }
+    if (pic) {
+        pic_eoi(8);
+    } else {
+        lapic_eoi();
+    }
+}
+
+static int irq_enabled(volatile struct ahci_abar *abar) {
+    for (int i = 0; i < irq_count; i++) {
+        if (irq_abars[i] == abar) {
+#ifdef BENCH
+            return !irq_polled;
+#else
+            return 1;
+#endif
+        }
+    }
+    return 0;
+}
+
+static void irq_line_unmask(volatile struct ahci_abar *abar) {
+    for (int i = 0; i < irq_count; i++) {
+        if (irq_abars[i] == abar && irq_lines[i]) {
+            pic_enable_irq(irq_lines[i]);
+        }
+    }
+}
+
+// Waits until the slots in sact are clear in PxSACT and the ones in ci in PxCI, or until a task
+// file error. The completion status bits are cleared before checking again, so that a completion
+// in between still raises the interrupt that ends the halt. The LAPIC timer ends it too, so an
+// interrupt that never arrives only slows the wait down to polling
+static void port_wait(volatile struct ahci_abar *abar, int index, uint32_t sact, uint32_t ci) {
+    volatile struct ahci_port *port = &abar->ports[index];
+    int irq = irq_enabled(abar);
+    while (((port->sata_active & sact) || (port->command_issue & ci)) && !(port->interrupt_status & AHCI_PORT_IS_TFES)) {
+#ifdef BENCH
+        irq_waits++;
+#endif
+        if (!irq) {
+            pause();
+            continue;
+        }
+        port->interrupt_status = AHCI_PORT_IS_DONE;
+        abar->ghc.interrupt_status = 1 << index;
+        if ((port->sata_active & sact) || (port->command_issue & ci)) {
+            abar->ghc.global_hba_control |= AHCI_GHC_CNT_IE;
+            irq_line_unmask(abar);
+            lapic_timer_start(AHCI_HALT_TICKS);
+            __asm__ volatile("sti\n\thlt\n\tcli");
+        }
+    }
+    if (irq) {
+        lapic_timer_start(0);
+    }
+}
+
+// Slots in busy are taken too, even if the HBA is done with them
+static int get_free_slot(volatile struct ahci_abar *abar, int index, uint32_t busy) {
+    uint32_t slots = abar->ports[index].sata_active | abar->ports[index].command_issue | busy;
     for (int i = 0; i < get_slots(abar); i++) {
         if (!(slots & (1 << i))) {
             return i;
         }
     }
+    return -1;
+}
+
+// The command table of the slot has to be filled already. Queued commands are marked in PxSACT,
+// and stay there until the device reports them done through a Set Device Bits FIS. Only commands
+// without data get the busy bit cleared as soon as the FIS is sent: the others must stay busy until
+// the device answers, or a data or SDB FIS could come in while the slot is already being reused
+static void command_issue(volatile struct ahci_abar *abar, int port, int slot, int write, int atapi, int prdt_len, int queued) {
+    volatile struct ahci_command_hdr *hdr = (volatile struct ahci_command_hdr *) abar->ports[port].commands_list_addr_low;
+    hdr += slot;
+    hdr->prdt_count = 0;
+    hdr->flags =
+          (prdt_len << AHCI_CMD_HDR_FLAGS_PRDTL_SHIFT)
+        | (prdt_len ? 0 : AHCI_CMD_HDR_FLAGS_C)
+        | (write ? AHCI_CMD_HDR_FLAGS_W : 0)
+        | (atapi ? AHCI_CMD_HDR_FLAGS_ATAPI : 0)
+        | (sizeof(struct ahci_fis_h2d) / 4)
+    ;
+    if (queued) {
+        abar->ports[port].sata_active = 1 << slot;
+    }
+    abar->ports[port].command_issue = 1 << slot;
+}
+
+static int port_busy(volatile struct ahci_port *port) {
+    return port->task_file_data & (AHCI_PORT_TFD_STS_BSY | AHCI_PORT_TFD_STS_DRQ);
+}
+
+// After a task file error the port stops processing commands until it is restarted,
+// which also drops all the ones still issued. A device still busy by then gets its task file
+// cleared with CLO, and then a COMRESET. Returns -1, with the port left stopped, if it's busy
+// even after that
+static int port_restart(volatile struct ahci_abar *abar, int index) {
+    volatile struct ahci_port *port = &abar->ports[index];
+    port->command_status &= ~AHCI_PORT_CMD_STS_ST;
+    while (port->command_status & AHCI_PORT_CMD_STS_CR) {
+        pause();
+    }
+    if (port_busy(port) && (abar->ghc.hba_capabilities & AHCI_CAP_SCLO)) {
+        port->command_status |= AHCI_PORT_CMD_STS_CLO;
+        while (port->command_status & AHCI_PORT_CMD_STS_CLO) {
+            pause();
+        }
+    }
+    if (port_busy(port)) {
+        print("AHCI: port %d is still busy after an error, resetting it", index);
+        port->sata_control = (port->sata_control & ~AHCI_PORT_SATA_CNT_DET_MASK) | AHCI_PORT_SATA_CNT_DET_INIT;
+        udelay(AHCI_COMRESET_DELAY);
+        port->sata_control &= ~AHCI_PORT_SATA_CNT_DET_MASK;
+        for (uint32_t waited = 0; waited < AHCI_READY_TIMEOUT; waited += AHCI_POLL_STEP) {
+            if ((port->sata_status & AHCI_PORT_SATA_STS_DET_MASK) == 3 && !port_busy(port)) {
+                break;
+            }
+            udelay(AHCI_POLL_STEP);
+        }
+    }
+    port->sata_error = port->sata_error;
+    port->interrupt_status = 0xffffffff;
+    if (port_busy(port)) {
+        print("AHCI: port %d could not be recovered", index);
+        return -1;
+    }
+    port->command_status |= AHCI_PORT_CMD_STS_ST;
     return 0;
 }
 
+// The command tables of all the slots are allocated here too, and bound to their headers for good
 static int port_alloc(volatile struct ahci_abar *abar, int index) {
     volatile struct ahci_port *port = (volatile struct ahci_port *) &abar->ports[index];
     uint32_t command_list = (uint32_t) calloc(sizeof(struct ahci_command_hdr) * get_slots(abar), 1024);
-    if (!command_list) {
-        print("AHCI: Could not allocate command list for port %d", port);
-        return -1;
-    }
     uint32_t receive_fis = (uint32_t) calloc(sizeof(struct ahci_fis_hba), 256);
-    if (!command_list) {
-        free((void *) command_list, sizeof(struct ahci_command_hdr) * get_slots(abar));
-        print("AHCI: Could not allocate receive FIS for port %d", port);
+    uint32_t tables = (uint32_t) calloc(AHCI_COMMAND_TBL_SIZE * get_slots(abar), 128);
+    if (!command_list || !receive_fis || !tables) {
+        if (command_list) {
+            free((void *) command_list, sizeof(struct ahci_command_hdr) * get_slots(abar));
+        }
+        if (receive_fis) {
+            free((void *) receive_fis, sizeof(struct ahci_fis_hba));
+        }
+        if (tables) {
+            free((void *) tables, AHCI_COMMAND_TBL_SIZE * get_slots(abar));
+        }
+        print("AHCI: Could not allocate the command list, receive FIS and command tables for port %d", index);
         return -1;
     }
-    port->commands_list_addr_low = command_list;
-    port->fis_addr_low = receive_fis;
+    for (int i = 0; i < get_slots(abar); i++) {
+        uint64_t table = tables + i * AHCI_COMMAND_TBL_SIZE;
+        ((struct ahci_command_hdr *) command_list)[i].command_table_low = (uint32_t) table;
+        ((struct ahci_command_hdr *) command_list)[i].command_table_hi = (uint32_t) (table >> 32);
+    }
+    port->commands_list_addr_low = (uint32_t) command_list;
+    port->fis_addr_low = (uint32_t) receive_fis;
     if (s64a_supported(abar)) {
-        port->commands_list_addr_hi = 0;
-        port->commands_list_addr_low = 0;
+        port->commands_list_addr_hi = (uint32_t) ((uint64_t) command_list >> 32);
+        port->fis_addr_hi = (uint32_t) ((uint64_t) receive_fis >> 32);
     }
     return 0;
 }
@@ -63,6 +249,7 @@ static int port_alloc(volatile struct ahci_abar *abar, int index) {
 static void port_free(volatile struct ahci_abar *abar, int index) {
     volatile struct ahci_port *port = (volatile struct ahci_port *) &abar->ports[index];
     if (port->commands_list_addr_low) {
+        free(ahci_command_table(abar, index, 0), AHCI_COMMAND_TBL_SIZE * get_slots(abar));
         free((void *) port->commands_list_addr_low, sizeof(struct ahci_command_hdr) * get_slots(abar));
     }
     if (port->fis_addr_low) {
@@ -86,81 +273,247 @@ static void port_deinit(volatile struct ahci_abar *abar, int index) {
 
 static int hal_submit(struct disk_abstract *disk, int flp);
 
-static int port_init(volatile struct ahci_abar *abar, uint8_t bus, uint8_t slot, uint8_t function, int index) {
-    volatile struct ahci_port *port = (volatile struct ahci_port *) &abar->ports[index];
-    port->command_status &= ~(AHCI_PORT_CMD_STS_FRE | AHCI_PORT_CMD_STS_ST);
-    while (port->command_status & (AHCI_PORT_CMD_STS_CR | AHCI_PORT_CMD_STS_FR)) {
-        pause();
-    }
-    port->interrupt_enable = 0;
-    port->interrupt_status = 0xffffffff;
-    if (port_alloc(abar, index) != 0) {
-        return -1;
-    }
-    if (sss_supported(abar)) {
-        // Staggered spinup
-        port->command_status |= AHCI_PORT_CMD_STS_SUD;
-    }
-    // Device must be brought up
-    if ((port->sata_status & AHCI_PORT_SATA_STS_DET_MASK) != 3) {
-        port_deinit(abar, index);
-        return -1;
+// Ports are brought up all together: they are stopped and reset at once, and then polled in the
+// same loop until their link is up and their device isn't busy anymore. With staggered spin-up,
+// the spin-ups (which reset the port too) are spread AHCI_SPINUP_STAGGER apart instead, so that
+// the drives don't all draw their spin-up current at once. Returns the ports that got there, the
+// others are left without any memory
+static uint32_t ports_bring_up(volatile struct ahci_abar *abar) {
+    int staggered = sss_supported(abar);
+    uint32_t ports = 0;
+    uint32_t spin_up[32] = {0}; // When each port is spun up, in microseconds
+    uint32_t timeout = AHCI_READY_TIMEOUT;
+    for (int i = 0; i < get_ports_silicon(abar); i++) {
+        if (port_implemented(abar, i)) {
+            abar->ports[i].command_status &= ~(AHCI_PORT_CMD_STS_FRE | AHCI_PORT_CMD_STS_ST);
+            ports |= 1 << i;
+            if (staggered) {
+                spin_up[i] = timeout - AHCI_READY_TIMEOUT;
+                timeout += AHCI_SPINUP_STAGGER;
+            }
+        }
     }
-    port->command_status |= AHCI_PORT_CMD_STS_FRE; // Otherwise, the status bits get stuck
-    // Clear errors and wait the device for being ready
-    port->sata_error |= port->sata_error;
-    if (port->task_file_data & (AHCI_PORT_TFD_STS_BSY | AHCI_PORT_TFD_STS_DRQ)) {
-        port_deinit(abar, index);
-        return -1;
+    for (int i = 0; i < get_ports_silicon(abar); i++) {
+        if (!(ports & (1 << i))) {
+            continue;
+        }
+        volatile struct ahci_port *port = &abar->ports[i];
+        while (port->command_status & (AHCI_PORT_CMD_STS_CR | AHCI_PORT_CMD_STS_FR)) {
+            pause();
+        }
+        port->interrupt_enable = 0;
+        port->interrupt_status = 0xffffffff;
+        if (staggered) {
+            // Back to listen mode, until its turn comes
+            port->command_status &= ~AHCI_PORT_CMD_STS_SUD;
+        } else {
+            port->sata_control = (port->sata_control & ~AHCI_PORT_SATA_CNT_DET_MASK) | AHCI_PORT_SATA_CNT_DET_INIT;
+        }
     }
-    // Execute commands
-    port->command_status |= AHCI_PORT_CMD_STS_ST;
-    // Identify
-    struct ahci_command_tbl *tbl = calloc(sizeof(struct ahci_command_tbl) + sizeof(struct ahci_prdt), 128);
-    if (!tbl) {
-        port_deinit(abar, index);
-        return -1;
+    if (!staggered) {
+        // COMRESET is sent for as long as DET stays at 1, which has to be at least 1ms
+        udelay(AHCI_COMRESET_DELAY);
+        for (int i = 0; i < get_ports_silicon(abar); i++) {
+            if (ports & (1 << i)) {
+                abar->ports[i].sata_control &= ~AHCI_PORT_SATA_CNT_DET_MASK;
+            }
+        }
     }
-    // The identify buffer is 512 bytes in size
-    uint16_t *identify_buffer = calloc(512, 1);
-    if (!identify_buffer) {
-        free(tbl, sizeof(struct ahci_command_tbl) + sizeof(struct ahci_prdt));
-        port_deinit(abar, index);
-        return -1;
+    uint32_t spun = staggered ? 0 : ports;
+    uint32_t linked = 0;
+    uint32_t ready = 0;
+    for (uint32_t waited = 0; waited < timeout && (ports & ~ready); waited += AHCI_POLL_STEP) {
+        for (int i = 0; i < get_ports_silicon(abar); i++) {
+            volatile struct ahci_port *port = &abar->ports[i];
+            if (!(ports & ~ready & (1 << i))) {
+                continue;
+            }
+            if (!(spun & (1 << i))) {
+                if (waited < spin_up[i]) {
+                    continue;
+                }
+                // Spinning up sends the COMRESET
+                port->command_status |= AHCI_PORT_CMD_STS_SUD;
+                spun |= 1 << i;
+            }
+            if (!(linked & (1 << i))) {
+                if ((port->sata_status & AHCI_PORT_SATA_STS_DET_MASK) != 3) {
+                    // Nothing attached
+                    if (waited >= spin_up[i] + AHCI_LINK_TIMEOUT) {
+                        ports &= ~(1 << i);
+                    }
+                    continue;
+                }
+                // Empty ports don't get any memory
+                if (port_alloc(abar, i) != 0) {
+                    ports &= ~(1 << i);
+                    continue;
+                }
+                port->command_status |= AHCI_PORT_CMD_STS_FRE; // Otherwise, the status bits get stuck
+                port->sata_error = port->sata_error;
+                linked |= 1 << i;
+            }
+            if (!port_busy(port)) {
+                ready |= 1 << i;
+            }
+        }
+        if (ports & ~ready) {
+            udelay(AHCI_POLL_STEP);
+        }
     }
-    tbl->command_fis.fis_kind = AHCI_FIS_H2D;
-    tbl->command_fis.command = ATA_COMMAND_IDENTIFY;
-    tbl->command_fis.flags = 1 << 7;
-    tbl->prdt[0].data_addr_low = (uint32_t) identify_buffer;
-    tbl->prdt[0].description = 512 - 1;
-    if (ahci_command(abar, index, 0, 0, tbl, 1) == -1) {
-        port_deinit(abar, index);
-        return -1;
+    for (int i = 0; i < get_ports_silicon(abar); i++) {
+        if (linked & ~ready & (1 << i)) {
+            print("AHCI: port %d is still busy after the reset", i);
+            port_deinit(abar, i);
+        }
     }
-    free(identify_buffer, 512);
-    // Submit to the HAL
+    return ready;
+}
+
+// Hands the disk behind an identified port over to the HAL
+static int port_register(volatile struct ahci_abar *abar, uint8_t bus, uint8_t slot, uint8_t function, int index, uint16_t *identify_buffer) {
     int lba48 = ata_common_identify_is_lba48(identify_buffer);
+    // One slot is always left out of the queue, for the commands that can't be queued
+    int ncq_depth = (abar->ghc.hba_capabilities & AHCI_CAP_SNCQ) ? ata_common_identify_ncq_depth(identify_buffer) : 0;
+    if (ncq_depth > get_slots(abar) - 1) {
+        ncq_depth = get_slots(abar) - 1;
+    }
     struct disk_abstract disk = {0};
     disk.interface = HAL_DISK_AHCI;
     disk.common.lba_max = ata_common_identify_sectors(identify_buffer, lba48);
+#ifdef BENCH
+    bench_sectors[index] = disk.common.lba_max;
+#endif
     disk.common.heads_per_cylinder = 16;
     disk.common.sectors_per_head = 255;
+    disk.common.max_transfer = AHCI_MAX_SECTORS * 512; // What one command takes, hal_rw_sg() chains past it anyway
     disk.specific.ahci.abar = abar;
     disk.specific.ahci.atapi = 0;
     disk.specific.ahci.port = index;
     disk.specific.ahci.lba48 = lba48;
+    disk.specific.ahci.ncq_depth = ncq_depth;
     disk.specific.ahci.drive = ATA_DRIVE_MASTER;
     disk.geography.interface = HAL_DISK_INTERCONNECT_PCI;
     disk.geography.pci.bus = bus;
     disk.geography.pci.slot = slot;
     disk.geography.pci.function = function;
     if (hal_submit(&disk, 0) == HAL_DISK_ENOMORE) {
-        port_deinit(abar, index);
         return -1;
     }
     return 0;
 }
 
+#define AHCI_IDENTIFY_BATCH (SCRATCH_PAGES * (SCRATCH_PAGE_SIZE / 512))
+
+// IDENTIFY goes out on every port of a batch before any of them is waited for. Each port gets
+// 512 bytes of a scratch page, so a batch is as many ports as the scratch pages have room for.
+// The disks are handed to the HAL in port order afterwards, and the ports that made it there
+// are returned
+static uint32_t ports_identify(volatile struct ahci_abar *abar, uint8_t bus, uint8_t slot, uint8_t function, uint32_t ready) {
+    uint32_t registered = 0;
+    while (ready) {
+        uint16_t *pages[SCRATCH_PAGES] = {0};
+        uint16_t *buffers[32] = {0};
+        uint32_t issued = 0;
+        int batched = 0;
+        for (int i = 0; i < get_ports_silicon(abar) && batched < AHCI_IDENTIFY_BATCH; i++) {
+            if (!(ready & (1 << i))) {
+                continue;
+            }
+            ready &= ~(1 << i);
+            int page = batched / (SCRATCH_PAGE_SIZE / 512);
+            if (!pages[page] && !(pages[page] = scratch_get())) {
+                port_deinit(abar, i);
+                continue;
+            }
+            buffers[i] = pages[page] + (batched % (SCRATCH_PAGE_SIZE / 512)) * 256;
+            batched++;
+            abar->ports[i].command_status |= AHCI_PORT_CMD_STS_ST;
+            struct ahci_command_tbl *tbl = ahci_command_table(abar, i, 0);
+            memset(tbl, 0, sizeof(struct ahci_command_tbl));
+            tbl->command_fis.fis_kind = AHCI_FIS_H2D;
+            tbl->command_fis.command = ATA_COMMAND_IDENTIFY;
+            tbl->command_fis.flags = 1 << 7;
+            uint64_t identify_buffer = (uintptr_t) buffers[i];
+            tbl->prdt[0].data_addr_low = (uint32_t) identify_buffer;
+            tbl->prdt[0].data_addr_hi = (uint32_t) (identify_buffer >> 32);
+            tbl->prdt[0].description = 512 - 1;
+            abar->ports[i].interrupt_status = 0xffffffff;
+            command_issue(abar, i, 0, 0, 0, 1, 0);
+            issued |= 1 << i;
+        }
+        uint32_t batch = issued;
+        uint32_t identified = 0;
+        for (uint32_t waited = 0; waited < AHCI_IDENTIFY_TIMEOUT && issued; waited += AHCI_POLL_STEP) {
+            for (int i = 0; i < get_ports_silicon(abar); i++) {
+                if ((issued & (1 << i)) && !(abar->ports[i].command_issue & 1)) {
+                    issued &= ~(1 << i);
+                    if (!(abar->ports[i].interrupt_status & AHCI_PORT_IS_TFES)) {
+                        identified |= 1 << i;
+                    }
+                }
+            }
+            if (issued) {
+                udelay(AHCI_POLL_STEP);
+            }
+        }
+        for (int i = 0; i < get_ports_silicon(abar); i++) {
+            if (!(batch & (1 << i))) {
+                continue;
+            }
+            if ((identified & (1 << i)) && port_register(abar, bus, slot, function, i, buffers[i]) == 0) {
+                registered |= 1 << i;
+            } else {
+                port_deinit(abar, i);
+            }
+        }
+        for (int i = 0; i < SCRATCH_PAGES; i++) {
+            if (pages[i]) {
+                scratch_put(pages[i]);
+            }
+        }
+    }
+    return registered;
+}
+
+// MSI first. Otherwise the INTx line, as long as it's on the slave PIC: the master one
+// is remapped over the exception vectors
+static void irq_setup(volatile struct ahci_abar *abar, uint8_t bus, uint8_t slot, uint8_t function, uint32_t ports) {
+    if (irq_count == AHCI_IRQ_CONTROLLERS) {
+        return;
+    }
+    int vector = pci_vector_alloc(1);
+    uint8_t line = pci_cfg_read_byte(bus, slot, function, PCI_CFG_INTERRUPT_LINE);
+    if (vector != -1 && pci_msi_enable(bus, slot, function, vector, 1) <= 0) {
+        pci_vector_free(vector, 1);
+        vector = -1;
+    }
+    if (vector != -1) {
+        idt_set(vector, ahci_irq_msi);
+        print("AHCI: Interrupts through MSI vector %x", vector);
+    } else if (line > 7 && line < 16) {
+        idt_set(pic_vector(line), ahci_irq_pic);
+        pic_set_level(line);
+        print("AHCI: Interrupts through IRQ %d", line);
+    } else {
+        print("AHCI: No usable interrupt, completions are polled");
+        return;
+    }
+    for (int i = 0; i < get_ports_silicon(abar); i++) {
+        if (ports & (1 << i)) {
+            abar->ports[i].interrupt_status = 0xffffffff;
+            abar->ports[i].interrupt_enable = AHCI_PORT_IS_DONE | AHCI_PORT_IS_TFES;
+        }
+    }
+    abar->ghc.interrupt_status = 0xffffffff;
+    irq_lines[irq_count] = vector == -1 ? line : 0;
+    irq_abars[irq_count++] = abar;
+}
+
+#ifdef BENCH
+static void irq_benchmark(volatile struct ahci_abar *abar, int port);
+#endif
+
 static int controller_init(uint8_t ahci_bus, uint8_t ahci_slot, uint8_t ahci_function) {
     volatile struct ahci_abar *abar = (volatile struct ahci_abar *) (uintptr_t) pci_get_bar(ahci_bus, ahci_slot, ahci_function, 5);
     if (!abar) {
@@ -173,9 +526,24 @@ static int controller_init(uint8_t ahci_bus, uint8_t ahci_slot, uint8_t ahci_fun
     while (abar->ghc.global_hba_control & AHCI_GHC_CNT_RESET) {
         pause();
     }
+    uint64_t start = rdtsc();
+    uint32_t ready = ports_bring_up(abar);
+    uint32_t registered = ports_identify(abar, ahci_bus, ahci_slot, ahci_function, ready);
+    print("AHCI: Ports brought up in %d kcycles", (int) ((rdtsc() - start) / 1000));
+    irq_setup(abar, ahci_bus, ahci_slot, ahci_function, registered);
+#ifdef BENCH
+    for (int i = 0; i < get_ports_silicon(abar); i++) {
+        if (registered & (1 << i)) {
+            if (irq_enabled(abar)) {
+                irq_benchmark(abar, i);
+            }
+            break;
+        }
+    }
+#endif
     for (int i = 0; i < get_ports_silicon(abar); i++) {
         if (port_implemented(abar, i)) {
-            if (port_init(abar, ahci_bus, ahci_slot, ahci_function, i) == 0) {
+            if (registered & (1 << i)) {
                 print("AHCI: port %d initialized successfully", i);
             } else {
                 print("AHCI: port %d could not be initialized", i);
@@ -213,49 +581,82 @@ void ahci_init() {
     print("AHCI: Finished initializing controllers");
 }
 
-int ahci_command(volatile struct ahci_abar *abar, int port, int write, int atapi, struct ahci_command_tbl *tbl, int prdt_len) {
+struct ahci_command_tbl *ahci_command_table(volatile struct ahci_abar *abar, int port, int slot) {
+    volatile struct ahci_command_hdr *hdr = (volatile struct ahci_command_hdr *) abar->ports[port].commands_list_addr_low;
+    return (struct ahci_command_tbl *) hdr[slot].command_table_low;
+}
+
+// Issues what the caller left in the command table of a free slot, and waits for it
+int ahci_command(volatile struct ahci_abar *abar, int port, int slot, int write, int atapi, int prdt_len) {
     if (atapi) {
         return -1;
     }
-    int slot = get_free_slot(abar, port);
-    if (slot == -1) {
+    // Queued commands can't be mixed with other ones, those in flight have to finish first.
+    // If one of them failed, the caller has to recover from it first (see sync_recover()). A port
+    // that couldn't be recovered stays stopped
+    port_wait(abar, port, 0xffffffff, 0);
+    if (abar->ports[port].sata_active || (abar->ports[port].interrupt_status & AHCI_PORT_IS_TFES)
+        || !(abar->ports[port].command_status & AHCI_PORT_CMD_STS_ST)) {
         return -1;
     }
-    volatile struct ahci_command_hdr *hdr = (volatile struct ahci_command_hdr *) abar->ports[port].commands_list_addr_low;
-    hdr += slot;
-    memset((void *) hdr, 0, sizeof(struct ahci_command_hdr));
-    hdr->flags =
-          (prdt_len << AHCI_CMD_HDR_FLAGS_PRDTL_SHIFT)
-        | (1 << 10)
-        | (write ? AHCI_CMD_HDR_FLAGS_W : 0) 
-        | (atapi ? AHCI_CMD_HDR_FLAGS_ATAPI : 0)
-        | (sizeof(struct ahci_fis_h2d) / 4)
-    ;
-    hdr->command_table_low = (uint32_t) tbl;
     abar->ports[port].interrupt_status = 0xffffffff;
     // Wait, issue, check
     while (abar->ports[port].task_file_data & (AHCI_PORT_TFD_STS_BSY | AHCI_PORT_TFD_STS_DRQ)) {
         pause();
     }
-    abar->ports[port].command_issue |= (1 << slot);
-    while (abar->ports[port].command_issue & (1 << slot)) {
-        pause();
-    }
-    if (abar->ports[port].interrupt_status & (1 << 30)) {
-        return -1;
-    } else {
+    command_issue(abar, port, slot, write, atapi, prdt_len, 0);
+    port_wait(abar, port, 0, 1 << slot);
+    if (!(abar->ports[port].interrupt_status & AHCI_PORT_IS_TFES)) {
         return 0;
     }
+    // With nothing else issued, nothing is lost by restarting the port right away. Otherwise
+    // error_recover() does it, and fails the requests that were dropped
+    if (abar->ports[port].command_issue == (uint32_t) (1 << slot)) {
+        port_restart(abar, port);
+    }
+    return -1;
 }
 
 /* HAL Functions */
 
-static int hal_rw(struct disk_abstract *this, void *buf, uint64_t lba, int len, int write) {
-    // TODO: PRDTs
-    struct ahci_command_tbl *tbl = calloc(sizeof(struct ahci_command_tbl) + sizeof(struct ahci_prdt), 128);
-    if (!tbl) {
-        return HAL_DISK_ENOMEM;
+// Fills the command table of the slot in place, with as much of the segments as one command
+// takes, starting skip bytes in. A PRDT entry ends at the end of its segment or at 4MB, and the
+// command when the table or the sector count is full. Returns the PRDT entries used, and the bytes
+// they cover in len. Queued commands are tagged with their slot
+static int rw_fill(struct disk_abstract *this, int slot, const struct disk_segment *segments, int count, uint64_t skip, uint64_t lba, int write, int queued, uint32_t *len) {
+    struct ahci_command_tbl *tbl = ahci_command_table(this->specific.ahci.abar, this->specific.ahci.port, slot);
+    int entries = 0;
+    *len = 0;
+    for (int i = 0; i < count && entries < AHCI_PRDT_PER_SLOT && *len < AHCI_MAX_SECTORS * 512; i++) {
+        if (skip >= segments[i].len) {
+            skip -= segments[i].len;
+            continue;
+        }
+        if ((uintptr_t) segments[i].buf & 1) {
+            return HAL_DISK_ENOIMPL;
+        }
+        while (skip < segments[i].len && entries < AHCI_PRDT_PER_SLOT && *len < AHCI_MAX_SECTORS * 512) {
+            uint32_t size = segments[i].len - skip;
+            if (size > AHCI_PRDT_MAX_BYTES) {
+                size = AHCI_PRDT_MAX_BYTES;
+            }
+            if (size > AHCI_MAX_SECTORS * 512 - *len) {
+                size = AHCI_MAX_SECTORS * 512 - *len;
+            }
+            uint64_t addr = (uintptr_t) segments[i].buf + skip;
+            if (!dma_addressable(this->specific.ahci.abar, addr)) {
+                return HAL_DISK_ENOIMPL;
+            }
+            tbl->prdt[entries].data_addr_low = (uint32_t) addr;
+            tbl->prdt[entries].data_addr_hi = (uint32_t) (addr >> 32);
+            tbl->prdt[entries].description = size - 1;
+            entries++;
+            skip += size;
+            *len += size;
+        }
+        skip = 0;
     }
+    memset(&tbl->command_fis, 0, sizeof(struct ahci_fis_h2d));
     tbl->command_fis.fis_kind = AHCI_FIS_H2D;
     tbl->command_fis.flags = 1 << 7;
     tbl->command_fis.device = this->specific.ahci.drive | (1 << 6); // LBA addressing
@@ -266,23 +667,243 @@ static int hal_rw(struct disk_abstract *this, void *buf, uint64_t lba, int len,
     tbl->command_fis.lba3 = (uint8_t) (lba >> 24);
     tbl->command_fis.lba4 = (uint8_t) (lba >> 32);
     tbl->command_fis.lba5 = (uint8_t) (lba >> 40);
-    tbl->command_fis.count_low = (uint8_t) (len / 512);
-    tbl->command_fis.count_hi = (uint8_t) ((len / 512) >> 8);
-    tbl->prdt[0].data_addr_low = (uint32_t) buf;
-    tbl->prdt[0].description = len - 1;
-    int ret = ahci_command(
-        this->specific.ahci.abar,
-        this->specific.ahci.port,
-        write,
-        this->specific.ahci.atapi,
-        tbl,
-        1
-    );
-    free(tbl, sizeof(struct ahci_command_tbl) + sizeof(struct ahci_prdt));
-    return ret != 0 ? HAL_DISK_EUNK : HAL_DISK_ESUCCESS;
+    // 65536 sectors wrap around to 0, as they should
+    if (queued) {
+        // The sector count moves to the features registers, to make room for the tag
+        tbl->command_fis.command = write ? ATA_COMMAND_WRITE_FPDMA_QUEUED : ATA_COMMAND_READ_FPDMA_QUEUED;
+        tbl->command_fis.device = 1 << 6; // Bit 7 is FUA here, and bit 5 is reserved
+        tbl->command_fis.features_low = (uint8_t) (*len / 512);
+        tbl->command_fis.features_hi = (uint8_t) ((*len / 512) >> 8);
+        tbl->command_fis.count_low = slot << 3;
+    } else {
+        tbl->command_fis.count_low = (uint8_t) (*len / 512);
+        tbl->command_fis.count_hi = (uint8_t) ((*len / 512) >> 8);
+    }
+    return entries;
+}
+
+static void error_recover(struct disk_abstract *this, uint32_t active);
+
+// Waits for the queued requests in flight, and recovers the port from an error among them right
+// away instead of leaving it for hal_request_poll(), which would fail every synchronous command
+// until then. Recovering issues the requests that weren't at fault again, so it's waited for again.
+// Returns -1 if the port is left stopped
+static int sync_recover(struct disk_abstract *this) {
+    volatile struct ahci_abar *abar = this->specific.ahci.abar;
+    volatile struct ahci_port *port = &abar->ports[this->specific.ahci.port];
+    for (;;) {
+        port_wait(abar, this->specific.ahci.port, 0xffffffff, 0);
+        if (!(port->interrupt_status & AHCI_PORT_IS_TFES)) {
+            break;
+        }
+        error_recover(this, port->sata_active | port->command_issue);
+    }
+    return (port->command_status & AHCI_PORT_CMD_STS_ST) ? 0 : -1;
+}
+
+// Commands are chained until all the segments are done. Any slot the HBA is done with will do,
+// even one of a request the HAL hasn't reaped yet
+static int hal_rw_sg(struct disk_abstract *this, const struct disk_segment *segments, int count, uint64_t lba, int write) {
+    uint64_t done = 0;
+    for (;;) {
+        if (sync_recover(this) != 0) {
+            return HAL_DISK_EUNK;
+        }
+        int slot;
+        while ((slot = get_free_slot(this->specific.ahci.abar, this->specific.ahci.port, 0)) == -1) {
+            pause();
+        }
+        uint32_t len;
+        int entries = rw_fill(this, slot, segments, count, done, lba, write, 0, &len);
+        if (entries <= 0) {
+            return entries;
+        }
+        int ret = ahci_command(
+            this->specific.ahci.abar,
+            this->specific.ahci.port,
+            slot,
+            write,
+            this->specific.ahci.atapi,
+            entries
+        );
+        if (ret != 0) {
+            // Requests issued along with it were dropped by the error, and are failed or issued again
+            if (this->specific.ahci.abar->ports[this->specific.ahci.port].interrupt_status & AHCI_PORT_IS_TFES) {
+                error_recover(this, this->specific.ahci.abar->ports[this->specific.ahci.port].command_issue);
+            }
+            return HAL_DISK_EUNK;
+        }
+        done += len;
+        lba += len / 512;
+    }
+}
+
+#ifdef BENCH
+// Reads the first MB of the disk, a page at a time, once spinning and once halting on the
+// interrupt. The halts are what the vCPU gets to spend idle, instead of spinning
+static void irq_benchmark(volatile struct ahci_abar *abar, int port) {
+    if (bench_sectors[port] < AHCI_BENCHMARK_READS * (SCRATCH_PAGE_SIZE / 512)) {
+        return;
+    }
+    struct disk_segment segment = {scratch_get(), SCRATCH_PAGE_SIZE};
+    if (!segment.buf) {
+        return;
+    }
+    struct disk_abstract disk = {0};
+    disk.specific.ahci.abar = abar;
+    disk.specific.ahci.port = port;
+    disk.specific.ahci.drive = ATA_DRIVE_MASTER;
+    uint32_t kcycles[2] = {0};
+    uint32_t waits[2] = {0};
+    for (int polled = 1; polled >= 0; polled--) {
+        irq_polled = polled;
+        irq_waits = 0;
+        uint64_t start = rdtsc();
+        for (int i = 0; i < AHCI_BENCHMARK_READS; i++) {
+            uint32_t len;
+            int entries = rw_fill(&disk, 0, &segment, 1, 0, i * (SCRATCH_PAGE_SIZE / 512), 0, 0, &len);
+            if (entries <= 0 || ahci_command(abar, port, 0, 0, 0, entries) != 0) {
+                irq_polled = 0;
+                scratch_put(segment.buf);
+                return;
+            }
+        }
+        kcycles[polled] = (rdtsc() - start) / 1000;
+        waits[polled] = irq_waits;
+    }
+    scratch_put(segment.buf);
+    print("AHCI: Port %d read %d pages in %d kcycles polled (%d spins), %d kcycles with interrupts (%d halts)",
+        port, AHCI_BENCHMARK_READS, kcycles[1], waits[1], kcycles[0], waits[0]);
+}
+#endif
+
+static int hal_rw(struct disk_abstract *this, void *buf, uint64_t lba, int len, int write) {
+    struct disk_segment segment = {buf, len};
+    return hal_rw_sg(this, &segment, 1, lba, write);
+}
+
+static uint32_t inflight_slots(struct disk_abstract *this) {
+    uint32_t busy = 0;
+    for (struct disk_request *inflight = this->requests.inflight; inflight; inflight = inflight->next) {
+        busy |= (uint32_t) inflight->tag;
+    }
+    return busy;
+}
+
+// Requests that don't fit in the PRDT of a slot are split in as many commands as they need, each
+// in its own free slot, and issued all at once. The request is tagged with the mask of those slots,
+// which aren't handed out again until the HAL has reaped it. Disks with NCQ get them as queued
+// commands, with each slot as the NCQ tag. Without enough free slots, the request waits for the ones
+// in flight, or is left for hal_rw_sg() to chain when nothing is
+static int hal_request_submit(struct disk_abstract *this, struct disk_request *request) {
+    volatile struct ahci_abar *abar = this->specific.ahci.abar;
+    int queued = this->specific.ahci.ncq_depth > 0;
+    uint32_t busy = inflight_slots(this);
+    uint64_t total = 0;
+    for (int i = 0; i < request->count; i++) {
+        total += request->segments[i].len;
+    }
+    uint32_t slots = 0;
+    uint8_t entries[32];
+    uint64_t done = 0;
+    while (done < total) {
+        int slot = get_free_slot(abar, this->specific.ahci.port, busy | slots);
+        if (slot == -1 || (queued && slot >= this->specific.ahci.ncq_depth)) {
+            return HAL_DISK_EBUSY;
+        }
+        uint32_t len;
+        int count = rw_fill(this, slot, request->segments, request->count, done, request->lba + (done / 512), request->write, queued, &len);
+        if (count <= 0) {
+            return count ? count : HAL_DISK_ENOIMPL;
+        }
+        entries[slot] = count;
+        slots |= 1 << slot;
+        done += len;
+    }
+    request->tag = slots;
+    for (int i = 0; i < 32; i++) {
+        if (slots & (1 << i)) {
+            command_issue(abar, this->specific.ahci.port, i, request->write, this->specific.ahci.atapi, entries[i], queued);
+        }
+    }
+    return HAL_DISK_ESUCCESS;
+}
+
+// When a queued command fails, the device aborts all the others. The NCQ error log tells which
+// one it was, and the rest are issued again. Without NCQ there is no telling, so all of them fail.
+// Requests that were done before the error went by are fine either way
+static void error_recover(struct disk_abstract *this, uint32_t active) {
+    volatile struct ahci_abar *abar = this->specific.ahci.abar;
+    int index = this->specific.ahci.port;
+    volatile struct ahci_command_hdr *hdr = (volatile struct ahci_command_hdr *) abar->ports[index].commands_list_addr_low;
+    // Without a working port, nothing that was still active can be issued again
+    if (port_restart(abar, index) != 0) {
+        for (struct disk_request *request = this->requests.inflight; request; request = request->next) {
+            request->status = (active & (uint32_t) request->tag) ? HAL_DISK_EUNK : HAL_DISK_ESUCCESS;
+        }
+        return;
+    }
+    int failed = -1;
+    int slot = get_free_slot(abar, index, inflight_slots(this));
+    uint8_t *log = this->specific.ahci.ncq_depth ? scratch_get() : NULL;
+    if (log && slot != -1) {
+        struct ahci_command_tbl *tbl = ahci_command_table(abar, index, slot);
+        memset(&tbl->command_fis, 0, sizeof(struct ahci_fis_h2d));
+        tbl->command_fis.fis_kind = AHCI_FIS_H2D;
+        tbl->command_fis.flags = 1 << 7;
+        tbl->command_fis.command = ATA_COMMAND_READ_LOG_EXT;
+        tbl->command_fis.lba0 = ATA_LOG_NCQ_ERROR;
+        tbl->command_fis.count_low = 1;
+        tbl->prdt[0].data_addr_low = (uint32_t) log;
+        tbl->prdt[0].data_addr_hi = (uint32_t) ((uint64_t) (uintptr_t) log >> 32);
+        tbl->prdt[0].description = 512 - 1;
+        if (ahci_command(abar, index, slot, 0, 0, 1) == 0 && !(log[0] & ATA_LOG_NCQ_ERROR_NQ)) {
+            failed = log[0] & ATA_LOG_NCQ_ERROR_TAG_MASK;
+        }
+    }
+    if (log) {
+        scratch_put(log);
+    }
+    print("AHCI: Recovering port %d from an error in tag %d", index, failed);
+    for (struct disk_request *request = this->requests.inflight; request; request = request->next) {
+        uint32_t slots = request->tag;
+        if (!(active & slots)) {
+            request->status = HAL_DISK_ESUCCESS;
+        } else if (failed == -1 || (slots & (1 << failed))) {
+            request->status = HAL_DISK_EUNK;
+        } else {
+            // The command tables are still there, untouched. The commands of the request that
+            // were done stay done
+            for (int i = 0; i < 32; i++) {
+                if (active & slots & (1 << i)) {
+                    hdr[i].prdt_count = 0;
+                    abar->ports[index].sata_active = 1 << i;
+                    abar->ports[index].command_issue = 1 << i;
+                }
+            }
+        }
+    }
+}
+
+// A request is done once all of its slots are clear in both PxCI and PxSACT
+static void hal_request_poll(struct disk_abstract *this) {
+    volatile struct ahci_port *port = &this->specific.ahci.abar->ports[this->specific.ahci.port];
+    uint32_t active = port->sata_active | port->command_issue;
+    if (port->interrupt_status & AHCI_PORT_IS_TFES) {
+        error_recover(this, active);
+        return;
+    }
+    for (struct disk_request *request = this->requests.inflight; request; request = request->next) {
+        if (!(active & (uint32_t) request->tag)) {
+            request->status = HAL_DISK_ESUCCESS;
+        }
+    }
 }
 
 static int hal_submit(struct disk_abstract *disk, int flp) {
     disk->ops.rw = hal_rw;
+    disk->ops.rw_sg = hal_rw_sg;
+    disk->ops.submit = hal_request_submit;
+    disk->ops.poll = hal_request_poll;
     return hal_disk_submit(disk, flp);
 }
@@ -97,14 +97,21 @@ struct ahci_prdt {
     uint32_t description;
 } __attribute__((__packed__));
 
+#define AHCI_PRDT_MAX_BYTES 0x400000 // The byte count of an entry is 22 bits
+#define AHCI_PRDT_PER_SLOT  8 // PRDT entries in the command table of every slot
+#define AHCI_MAX_SECTORS    0x10000 // Per READ/WRITE DMA EXT command
+
 // CCC: Command Completion Coalescenting
 // EM: Enclosure Management
 #define AHCI_CAP_64 (1 << 31)
+#define AHCI_CAP_SNCQ (1 << 30)
 #define AHCI_CAP_SMPS (1 << 28)
 #define AHCI_CAP_SSS (1 << 27)
+#define AHCI_CAP_SCLO (1 << 24)
 #define AHCI_CAP_PORTS_MASK 0x1f
 #define AHCI_CAP_SLOTS_MASK 0x1f
 #define AHCI_GHC_CNT_AE (1 << 31)
+#define AHCI_GHC_CNT_IE (1 << 1)
 #define AHCI_GHC_CNT_RESET (1 << 0)
 #define AHCI_GHC_CAP_EXT_BIOS (1 << 0)
 #define AHCI_GHC_BIOS_BOS (1 << 0)
@@ -122,14 +129,22 @@ struct ahci_ghc {
     uint32_t bios_handoff_cnt_sts;
 } __attribute__((__packed__));
 
+#define AHCI_PORT_IS_TFES (1 << 30)
+#define AHCI_PORT_IS_SDBS (1 << 3)
+#define AHCI_PORT_IS_PSS (1 << 1)
+#define AHCI_PORT_IS_DHRS (1 << 0)
+#define AHCI_PORT_IS_DONE (AHCI_PORT_IS_SDBS | AHCI_PORT_IS_PSS | AHCI_PORT_IS_DHRS)
 #define AHCI_PORT_CMD_STS_CR (1 << 15)
 #define AHCI_PORT_CMD_STS_FR (1 << 14)
 #define AHCI_PORT_CMD_STS_FRE (1 << 4)
+#define AHCI_PORT_CMD_STS_CLO (1 << 3)
 #define AHCI_PORT_CMD_STS_SUD (1 << 2)
 #define AHCI_PORT_CMD_STS_ST (1 << 0)
 #define AHCI_PORT_TFD_STS_DRQ (1 << 3)
 #define AHCI_PORT_TFD_STS_BSY (1 << 7)
 #define AHCI_PORT_SATA_STS_DET_MASK 0x0f
+#define AHCI_PORT_SATA_CNT_DET_MASK 0x0f
+#define AHCI_PORT_SATA_CNT_DET_INIT 1
 struct ahci_port {
     uint32_t commands_list_addr_low;
     uint32_t commands_list_addr_hi;
@@ -152,6 +167,7 @@ struct ahci_port {
     uint32_t reserved2[14];
 } __attribute__((__packed__));
 
+#define AHCI_CMD_HDR_FLAGS_C (1 << 10)
 #define AHCI_CMD_HDR_FLAGS_W (1 << 6)
 #define AHCI_CMD_HDR_FLAGS_ATAPI (1 << 5)
 #define AHCI_CMD_HDR_FLAGS_PRDTL_SHIFT 16
@@ -177,7 +193,22 @@ struct ahci_abar {
     struct ahci_port ports[32];
 } __attribute__((__packed__));
 
+#define AHCI_COMMAND_TBL_SIZE (sizeof(struct ahci_command_tbl) + sizeof(struct ahci_prdt) * AHCI_PRDT_PER_SLOT)
+
+// Port bring-up timeouts, in microseconds. The link has to come up within 10ms of COMRESET
+#define AHCI_POLL_STEP        100
+#define AHCI_COMRESET_DELAY   1000
+#define AHCI_LINK_TIMEOUT     10000
+#define AHCI_READY_TIMEOUT    1000000
+#define AHCI_IDENTIFY_TIMEOUT 5000000
+#define AHCI_SPINUP_STAGGER   50000 // Between the spin-ups of two ports, with staggered spin-up
+
+#define AHCI_IRQ_CONTROLLERS 4 // Controllers that can get an interrupt, the rest are polled
+#define AHCI_HALT_TICKS 0x100000 // LAPIC timer ticks a wait halts for at most
+#define AHCI_BENCHMARK_READS 256
+
 void ahci_init();
-int ahci_command(volatile struct ahci_abar *abar, int port, int write, int atapi, struct ahci_command_tbl *tbl, int prdt_len);
+struct ahci_command_tbl *ahci_command_table(volatile struct ahci_abar *abar, int port, int slot);
+int ahci_command(volatile struct ahci_abar *abar, int port, int slot, int write, int atapi, int prdt_len);
 
 #endif
@@ -11,3 +11,11 @@ uint64_t ata_common_identify_sectors(const uint16_t *identify, int lba48) {
         return *((uint32_t *) &identify[60]);
     }
 }
+
+// 0 when NCQ is not supported
+int ata_common_identify_ncq_depth(const uint16_t *identify) {
+    if (!(identify[76] & (1 << 8))) {
+        return 0;
+    }
+    return (identify[75] & 0x1f) + 1;
+}
@@ -11,8 +11,16 @@
 #define ATA_COMMAND_WRITE 0x34
 #define ATA_COMMAND_WRITE_DMA_EXT 0x35
 #define ATA_COMMAND_IDENTIFY 0xec
+#define ATA_COMMAND_READ_LOG_EXT 0x2f
+#define ATA_COMMAND_READ_FPDMA_QUEUED 0x60
+#define ATA_COMMAND_WRITE_FPDMA_QUEUED 0x61
+
+#define ATA_LOG_NCQ_ERROR 0x10
+#define ATA_LOG_NCQ_ERROR_NQ (1 << 7) // The error was not in a queued command
+#define ATA_LOG_NCQ_ERROR_TAG_MASK 0x1f
 
 int ata_common_identify_is_lba48(const uint16_t *identify);
 uint64_t ata_common_identify_sectors(const uint16_t *identify, int lba48);
+int ata_common_identify_ncq_depth(const uint16_t *identify);
 
 #endif
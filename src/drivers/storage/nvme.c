@@ -5,11 +5,9 @@
 #include <tools/alloc.h>
 #include <tools/math.h>
 #include <tools/print.h>
+#include <tools/scratch.h>
 #include <tools/string.h>
 
-// TODO:
-// 1. Make the IO queues shareable between namespaces of a controller. Right now they will just collide
-
 #define ADMIN_ENTRIES 16
 #define IO_ENTRIES 32
 
@@ -32,41 +30,70 @@ static void controller_reset(volatile struct nvme_configuration *cfg) {
     }
 }
 
+// Only the IO queue pair, its PRP lists and bookkeeping stay allocated once a controller
+// has been initialized, check that they fit before touching the controller. Each of them is
+// allocated on its own, so free pages are enough, they don't need to be contiguous
+static int io_queues_fit() {
+    return alloc_count_free(SCRATCH_PAGE_SIZE, SCRATCH_PAGE_SIZE) >= 2 + NVME_PRP_LISTS;
+}
+
 static int hal_submit(struct disk_abstract *disk, int flp);
 
+#ifdef BENCH
+#define BENCHMARK_READS 256
+
+// Reads the first MB of the namespace, a page at a time, and returns how many kcycles it took
+static uint32_t read_benchmark(volatile struct nvme_configuration *cfg, struct nvme_queue *io, uint32_t namespace_id, void *buf) {
+    struct nvme_submission_entry cmd = {0};
+    cmd.opcode = 0x02;
+    cmd.namespace_id = namespace_id;
+    cmd.prp1 = (uint64_t) (uintptr_t) buf;
+    cmd.cmd_specific[2] = (SCRATCH_PAGE_SIZE / 512) - 1;
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCHMARK_READS; i++) {
+        cmd.cmd_specific[0] = i * (SCRATCH_PAGE_SIZE / 512);
+        if (nvme_command(cfg, &cmd, io) != 0) {
+            return 0;
+        }
+    }
+    return (rdtsc() - start) / 1000;
+}
+#endif
+
 static int controller_init(uint8_t nvme_bus, uint8_t nvme_slot, uint8_t nvme_function) {
     pci_control_set(nvme_bus, nvme_slot, nvme_function, PCI_CFG_COMMAND_BUS_MASTER | PCI_CFG_COMMAND_IO_ENABLE | PCI_CFG_COMMAND_MEM_ENABLE);
     volatile struct nvme_configuration *cfg = (volatile struct nvme_configuration *) (uintptr_t) pci_get_bar(nvme_bus, nvme_slot, nvme_function, 0);
     if (!cfg) {
         return -1;
     }
-    // Get alignments
+    // The scratch pages double as the queues, so the controller page size must match them
     int mpsmin = get_mpsmin(cfg);
-    int alignment = pow(2, 12 + mpsmin);
-    // Before continuing, allocate all required buffers
-    void *asq = calloc(sizeof(struct nvme_submission_entry) * ADMIN_ENTRIES, alignment);
-    void *acq = calloc(sizeof(struct nvme_completion_entry) * ADMIN_ENTRIES, alignment);
-    void *isq = calloc(sizeof(struct nvme_submission_entry) * IO_ENTRIES, alignment);
-    void *icq = calloc(sizeof(struct nvme_completion_entry) * IO_ENTRIES, alignment);
-    void *identify = calloc(4096, alignment);
-    if (!asq) {
-        print("NVME: Could not allocate the Admin Submission Queue");
-        goto free;
-    }
-    if (!acq) {
-        print("NVME: Could not allocate the Admin Completion Queue");
-        goto free;
+    if (pow(2, 12 + mpsmin) != SCRATCH_PAGE_SIZE) {
+        print("NVME: Controllers with a minimum page size bigger than 4KB are not supported");
+        return -1;
     }
-    if (!isq) {
-        print("NVME: Could not allocate the IO Submission Queue");
-        goto free;
+    int io_entries = (cfg->capabilities & NVME_CFG_CAP_MQES_MASK) + 1;
+    if (io_entries > IO_ENTRIES) {
+        io_entries = IO_ENTRIES;
     }
-    if (!icq) {
-        print("NVME: Could not allocate the IO Completion Queue");
-        goto free;
+    if (!io_queues_fit()) {
+        print("NVME: Not enough heap left for the IO queues of this controller");
+        return -1;
     }
-    if (!identify) {
-        print("NVME: Could not allocate the IDENTIFY buffer");
+    // The admin queues and the IDENTIFY data are only used during init. The BIOS never
+    // issues admin commands afterwards, so they can be borrowed from the scratch pool
+    struct nvme_queue admin = {0};
+    admin.sq = scratch_get();
+    admin.cq = scratch_get();
+    admin.entries = ADMIN_ENTRIES;
+    admin.phase = 1;
+    void *identify = scratch_get();
+    struct nvme_queue *io = NULL;
+    void *isq = NULL;
+    void *icq = NULL;
+    uint64_t *prp_lists[NVME_PRP_LISTS] = {0};
+    if (!admin.sq || !admin.cq || !identify) {
+        print("NVME: Could not get the scratch pages for the admin queues and IDENTIFY data");
         goto free;
     }
     // Initialize controller
@@ -79,8 +106,8 @@ static int controller_init(uint8_t nvme_bus, uint8_t nvme_slot, uint8_t nvme_fun
     }
     // Set the admin queues
     cfg->admin_queue_attrs = ((ADMIN_ENTRIES - 1) << NVME_AQA_ACQS_SHIFT) | ((ADMIN_ENTRIES - 1) << NVME_AQA_ASQS_SHIFT);
-    cfg->admin_submission_queue_addr = (uint64_t) (uintptr_t) asq;
-    cfg->admin_completion_queue_addr = (uint64_t) (uintptr_t) acq;
+    cfg->admin_submission_queue_addr = (uint64_t) (uintptr_t) admin.sq;
+    cfg->admin_completion_queue_addr = (uint64_t) (uintptr_t) admin.cq;
     // Set configuration and enable the controller
     cfg->controller_config =
           (4 << NVME_CFG_CC_IOCQES_SHIFT) // 2^4 = 16: Completion entry size
@@ -99,125 +126,171 @@ static int controller_init(uint8_t nvme_bus, uint8_t nvme_slot, uint8_t nvme_fun
         }
     }
     // Setup namespaces
-    uint32_t admin_head = 0;
-    uint32_t admin_tail = 0;
-    int admin_phase = 1;
-    uint32_t io_head = 0;
-    uint32_t io_tail = 0;
-    int io_phase = 1;
     uint32_t namespaces;
-    uint32_t *namespace_list;
+    uint32_t namespace_list[MAX_DISKS];
+    uint64_t namespace_sectors[MAX_DISKS];
+    int usable_namespaces = 0;
     struct nvme_submission_entry cmd;
     // 1. Identify the controller to know its namespaces
     memset(&cmd, 0, sizeof(struct nvme_submission_entry));
     cmd.opcode = NVME_CMD_ADMIN_ID;
     cmd.prp1 = (uint64_t) (uintptr_t) identify;
     cmd.cmd_specific[0] = NVME_CMD_ADMIN_ID_CONTROLLER;
-    if (nvme_command(cfg, &cmd, asq, acq, 0, &admin_tail, &admin_head, &admin_phase) != 0) {
+    if (nvme_command(cfg, &cmd, &admin) != 0) {
         print("NVME: Could not send IDENTIFY command to the controller");
         goto free;
     }
     namespaces = *((uint32_t *) ((uintptr_t) identify + 516));
+    uint8_t mdts = *((uint8_t *) identify + 77);
     if (!namespaces) {
         print("NVME: Controller has no namespaces");
         goto free;
     }
-    // 2. Query the namespace list
-    namespace_list = calloc(namespaces * sizeof(uint32_t), alignment);
-    if (!namespace_list) {
-        print("NVME: Could not allocate the namespace list");
-        goto free;
-    }
+    // 2. Query the active namespace list. No more namespaces than the HAL can hold are kept
     memset(&cmd, 0, sizeof(struct nvme_submission_entry));
     cmd.opcode = NVME_CMD_ADMIN_ID;
-    cmd.prp1 = (uint64_t) (uintptr_t) namespace_list;
+    cmd.prp1 = (uint64_t) (uintptr_t) identify;
     cmd.cmd_specific[0] = NVME_CMD_ADMIN_ID_NAMESPACES;
-    if (nvme_command(cfg, &cmd, asq, acq, 0, &admin_tail, &admin_head, &admin_phase) != 0) {
+    if (nvme_command(cfg, &cmd, &admin) != 0) {
         print("NVME: Could not query the namespace list");
         goto free;
     }
-    // 3.   Set up the IO queues
-    // 3.1. Set up the IO Completion Queue
+    if (namespaces > MAX_DISKS) {
+        namespaces = MAX_DISKS;
+    }
+    memcpy(namespace_list, identify, namespaces * sizeof(uint32_t));
+    // 3. Identify all the individual namespaces, and keep the ones that can be used
+    for (uint32_t i = 0; i < namespaces && namespace_list[i]; i++) {
+        memset(&cmd, 0, sizeof(struct nvme_submission_entry));
+        cmd.opcode = NVME_CMD_ADMIN_ID;
+        cmd.prp1 = (uint64_t) (uintptr_t) identify;
+        cmd.cmd_specific[0] = NVME_CMD_ADMIN_ID_NAMESPACE;
+        cmd.namespace_id = namespace_list[i];
+        if (nvme_command(cfg, &cmd, &admin) != 0) {
+            print("NVME: Could not send IDENTIFY command to namespace #%d", namespace_list[i]);
+            not_initialized_namespaces++;
+            continue;
+        }
+        // Only namespaces formatted with 512 byte sectors are supported
+        uint64_t sectors = *((uint64_t *) identify);
+        uint8_t lba_format = *((uint8_t *) identify + 26) & 0x0f;
+        uint8_t lba_shift = *((uint8_t *) identify + 128 + (lba_format * 4) + 2);
+        if (!sectors || lba_shift != 9) {
+            print("NVME: Namespace #%d is empty or does not use 512 byte sectors", namespace_list[i]);
+            not_initialized_namespaces++;
+            continue;
+        }
+        namespace_list[usable_namespaces] = namespace_list[i];
+        namespace_sectors[usable_namespaces] = sectors;
+        usable_namespaces++;
+    }
+    if (!usable_namespaces) {
+        print("NVME: Controller has no usable namespaces");
+        goto free;
+    }
+    // 4.   Set up the IO queues, now that it is known they will be used.
+    //      The page aligned queues go first so the small bookkeeping fits in the gaps they leave
+    isq = calloc(sizeof(struct nvme_submission_entry) * io_entries, SCRATCH_PAGE_SIZE);
+    icq = calloc(sizeof(struct nvme_completion_entry) * io_entries, SCRATCH_PAGE_SIZE);
+    int prp_lists_allocated = 0;
+    while (prp_lists_allocated < NVME_PRP_LISTS && (prp_lists[prp_lists_allocated] = calloc(SCRATCH_PAGE_SIZE, SCRATCH_PAGE_SIZE))) {
+        prp_lists_allocated++;
+    }
+    io = calloc(sizeof(struct nvme_queue), 4);
+    if (!isq || !icq || prp_lists_allocated != NVME_PRP_LISTS || !io) {
+        print("NVME: Could not allocate the IO queues");
+        goto free;
+    }
+    io->sq = isq;
+    io->cq = icq;
+    io->id = 1;
+    io->entries = io_entries;
+    io->phase = 1;
+    memcpy(io->prp_lists, prp_lists, sizeof(prp_lists));
+    io->max_transfer = mdts && mdts < 20 ? SCRATCH_PAGE_SIZE << mdts : 0; // Bigger limits would not fit anyway
+    // 4.1. Set up the IO Completion Queue
     memset(&cmd, 0, sizeof(struct nvme_submission_entry));
     cmd.opcode = NVME_CMD_ADMIN_CREATE_ICQ;
     cmd.prp1 = (uint64_t) (uintptr_t) icq;
-    cmd.cmd_specific[0] = ((IO_ENTRIES - 1) << 16) | 1;
+    cmd.cmd_specific[0] = ((io_entries - 1) << 16) | io->id;
     cmd.cmd_specific[1] = 1 << 0; // Physically contiguous
-    if (nvme_command(cfg, &cmd, asq, acq, 0, &admin_tail, &admin_head, &admin_phase) != 0) {
+    if (nvme_command(cfg, &cmd, &admin) != 0) {
         print("NVME: Could not set the IO Completion Queue");
         goto free;
     }
-    // 3.2. Set up the IO Submission Queue
+    // 4.2. Set up the IO Submission Queue
     memset(&cmd, 0, sizeof(struct nvme_submission_entry));
     cmd.opcode = NVME_CMD_ADMIN_CREATE_ISQ;
     cmd.prp1 = (uint64_t) (uintptr_t) isq;
-    cmd.cmd_specific[0] = ((IO_ENTRIES - 1) << 16) | 1;
-    cmd.cmd_specific[1] = (1 << 16) | (1 << 0); // Physically contiguous
-    if (nvme_command(cfg, &cmd, asq, acq, 0, &admin_tail, &admin_head, &admin_phase) != 0) {
+    cmd.cmd_specific[0] = ((io_entries - 1) << 16) | io->id;
+    cmd.cmd_specific[1] = (io->id << 16) | (1 << 0); // Physically contiguous
+    if (nvme_command(cfg, &cmd, &admin) != 0) {
         print("NVME: Could not set the IO Submission Queue");
         goto free;
     }
-    // 4. Set up all the individual namespaces
-    for (uint32_t i = 0; i < namespaces; i++) {
-        // 4.1. Identify the namespace
-        memset(&cmd, 0, sizeof(struct nvme_submission_entry));
-        cmd.opcode = NVME_CMD_ADMIN_ID;
-        cmd.prp1 = (uint64_t) (uintptr_t) identify;
-        cmd.cmd_specific[0] = NVME_CMD_ADMIN_ID_NAMESPACE;
-        cmd.namespace_id = namespace_list[i];
-        if (nvme_command(cfg, &cmd, asq, acq, 0, &io_tail, &io_head, &io_phase) != 0) {
-            print("NVME: Could not send IDENTIFY command to namespace #%d", namespace_list[i]);
-            not_initialized_namespaces++;
-            continue;
-        }
-        // 4.2. Submit it to the HAL
+    // 5. Submit the namespaces to the HAL
+    for (int i = 0; i < usable_namespaces; i++) {
         struct disk_abstract disk = {0};
         disk.interface = HAL_DISK_NVME;
-        disk.common.lba_max = (uint64_t) *((uint32_t *) identify + 0);
+        disk.common.lba_max = namespace_sectors[i];
         disk.common.heads_per_cylinder = 16;
         disk.common.sectors_per_head = 255;
+        disk.common.max_transfer = 0x10000 * 512; // What the sector count takes. MDTS is up to hal_rw()
         disk.specific.nvme.cfg = cfg;
-        disk.specific.nvme.cq = icq;
-        disk.specific.nvme.sq = isq;
+        disk.specific.nvme.queue = io;
         disk.specific.nvme.namespace_id = namespace_list[i];
-        disk.specific.nvme.queue_id = 1;
-        disk.specific.nvme.head = io_head;
-        disk.specific.nvme.tail = io_tail;
-        disk.specific.nvme.phase = io_phase;
         disk.geography.interface = HAL_DISK_INTERCONNECT_PCI;
         disk.geography.pci.bus = nvme_bus;
         disk.geography.pci.slot = nvme_slot;
         disk.geography.pci.function = nvme_function;
         if (hal_submit(&disk, 0) == HAL_DISK_ENOMORE) {
+            not_initialized_namespaces += usable_namespaces - i;
             break;
         }
     }
-    if ((uint32_t) not_initialized_namespaces == namespaces) {
-        goto free;
-    } else {
-        goto success;
+#ifdef BENCH
+    // 6. Compare reads with the power on 128 byte payloads against the ones PCI set up
+    int mps;
+    int mrrs;
+    if (namespace_sectors[0] >= BENCHMARK_READS * (SCRATCH_PAGE_SIZE / 512)
+        && pci_pcie_payload_get(nvme_bus, nvme_slot, nvme_function, &mps, &mrrs) == 0 && (mps > 128 || mrrs > 128)) {
+        pci_pcie_payload_set(nvme_bus, nvme_slot, nvme_function, 128, 128);
+        uint32_t before = read_benchmark(cfg, io, namespace_list[0], identify);
+        pci_pcie_payload_set(nvme_bus, nvme_slot, nvme_function, mps, mrrs);
+        uint32_t after = read_benchmark(cfg, io, namespace_list[0], identify);
+        print("NVME: Reading 1MB took %d kcycles with 128 byte payloads, %d kcycles with %d/%d byte ones", before, after, mps, mrrs);
     }
+#endif
+    scratch_put((void *) admin.sq);
+    scratch_put((void *) admin.cq);
+    scratch_put(identify);
+    return not_initialized_namespaces;
 free:
     controller_reset(cfg);
-    if (asq) {
-        free(asq, sizeof(struct nvme_submission_entry) * ADMIN_ENTRIES);
+    if (admin.sq) {
+        scratch_put((void *) admin.sq);
     }
-    if (acq) {
-        free(acq, sizeof(struct nvme_completion_entry) * ADMIN_ENTRIES);
+    if (admin.cq) {
+        scratch_put((void *) admin.cq);
+    }
+    if (identify) {
+        scratch_put(identify);
     }
     if (isq) {
-        free(isq, sizeof(struct nvme_submission_entry) * IO_ENTRIES);
+        free(isq, sizeof(struct nvme_submission_entry) * io_entries);
     }
     if (icq) {
-        free(icq, sizeof(struct nvme_completion_entry) * IO_ENTRIES);
+        free(icq, sizeof(struct nvme_completion_entry) * io_entries);
     }
-    if (identify) {
-        free(identify, 4096);
+    for (int i = 0; i < NVME_PRP_LISTS; i++) {
+        if (prp_lists[i]) {
+            free(prp_lists[i], SCRATCH_PAGE_SIZE);
+        }
+    }
+    if (io) {
+        free(io, sizeof(struct nvme_queue));
     }
     return -1;
-success:
-    free(identify, 4096);
-    return not_initialized_namespaces;
 }
 
 void nvme_init() {
@@ -251,60 +324,188 @@ void nvme_init() {
     print("NVME: Finished initializing controllers");
 }
 
-int nvme_command(
-    volatile struct nvme_configuration *cfg, struct nvme_submission_entry *command,
-    volatile struct nvme_submission_entry *sq, volatile struct nvme_completion_entry *cq,
-    int id, uint32_t *tail_ptr, uint32_t *head_ptr, int *phase
-) {
-    // Some variables and get locations of the doorbells
-    uint32_t stride = get_dstrd(cfg);
-    volatile uint32_t *s_tail_doorbell = (volatile uint32_t *) ((uintptr_t) cfg + 0x1000 + ((2 * id) * (4 << stride)));
-    volatile uint32_t *c_head_doorbell = (volatile uint32_t *) ((uintptr_t) cfg + 0x1000 + ((2 * id + 1) * (4 << stride)));
-    // Send the command
-    memcpy((void *) &sq[*tail_ptr], command, sizeof(struct nvme_submission_entry));
-    *tail_ptr = *tail_ptr + 1;
-    if (*tail_ptr == IO_ENTRIES) {
-        *tail_ptr = 0;
-    }
-    *s_tail_doorbell = *tail_ptr;
-    // Wait for it to finish
-    while (!((cq[*head_ptr].status & NVME_C_ENT_STS_PHASE) == *phase)) {
-        pause();
+static volatile uint32_t *get_doorbell(volatile struct nvme_configuration *cfg, struct nvme_queue *queue, int completion) {
+    return (volatile uint32_t *) ((uintptr_t) cfg + 0x1000 + ((2 * queue->id + completion) * (4 << get_dstrd(cfg))));
+}
+
+static void submit_entry(volatile struct nvme_configuration *cfg, struct nvme_submission_entry *command, struct nvme_queue *queue) {
+    memcpy((void *) &queue->sq[queue->tail], command, sizeof(struct nvme_submission_entry));
+    queue->tail++;
+    if (queue->tail == (uint32_t) queue->entries) {
+        queue->tail = 0;
+    }
+    *get_doorbell(cfg, queue, 0) = queue->tail;
+}
+
+// List 0 is left for nvme_command(), which is done with it by the time it returns
+static uint64_t *prp_list_get(struct nvme_queue *queue) {
+    for (int i = 1; i < NVME_PRP_LISTS; i++) {
+        if (!(queue->prp_lists_used & (1 << i))) {
+            queue->prp_lists_used |= 1 << i;
+            return queue->prp_lists[i];
+        }
     }
-    if (cq[*head_ptr].status >> 1) {
+    return NULL;
+}
+
+static void prp_list_put(struct nvme_queue *queue, uint64_t *list) {
+    for (int i = 1; i < NVME_PRP_LISTS; i++) {
+        if (queue->prp_lists[i] == list) {
+            queue->prp_lists_used &= ~(1 << i);
+        }
+    }
+}
+
+// Takes the next completion, if there is any, and returns its command ID. Completions can come
+// in any order, the ones of asynchronous requests are handed to them on the way
+static int reap(volatile struct nvme_configuration *cfg, struct nvme_queue *queue, int *failed) {
+    volatile struct nvme_completion_entry *entry = &queue->cq[queue->head];
+    if ((entry->status & NVME_C_ENT_STS_PHASE) != queue->phase) {
         return -1;
     }
-    // Update head
-    *head_ptr = *head_ptr + 1;
-    if (*head_ptr == IO_ENTRIES) {
-        *head_ptr = 0;
-        *phase = !*phase;
+    int id = entry->command_id;
+    *failed = entry->status >> 1;
+    // Update head, even on errors, so the queue stays in sync with the controller
+    queue->head++;
+    if (queue->head == (uint32_t) queue->entries) {
+        queue->head = 0;
+        queue->phase = !queue->phase;
+    }
+    *get_doorbell(cfg, queue, 1) = queue->head;
+    if (id < NVME_MAX_REQUESTS && queue->requests[id]) {
+        if (queue->requests[id]->driver) {
+            prp_list_put(queue, queue->requests[id]->driver);
+        }
+        queue->requests[id]->status = *failed ? HAL_DISK_EUNK : HAL_DISK_ESUCCESS;
+        queue->requests[id] = NULL;
+    }
+    return id;
+}
+
+int nvme_command(volatile struct nvme_configuration *cfg, struct nvme_submission_entry *command, struct nvme_queue *queue) {
+    command->command_id = NVME_SYNC_ID;
+    submit_entry(cfg, command, queue);
+    int failed;
+    int id;
+    while ((id = reap(cfg, queue, &failed)) != NVME_SYNC_ID) {
+        if (id == -1) {
+            pause();
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+// PRP entries can only describe the segments if just the start of the first one and the end
+// of the last one fall inside a page, and every one is dword aligned. Other lists are left to
+// the HAL, a segment at a time. Without a PRP list only two pages can be described
+static int rw_command(struct disk_abstract *this, const struct disk_segment *segments, int count, uint64_t lba, int write, struct nvme_submission_entry *cmd, uint64_t *list) {
+    struct nvme_queue *queue = this->specific.nvme.queue;
+    uint64_t len = 0;
+    int entries = 0;
+    for (int i = 0; i < count; i++) {
+        uintptr_t start = (uintptr_t) segments[i].buf;
+        uintptr_t end = start + segments[i].len;
+        if ((i > 0 && start % SCRATCH_PAGE_SIZE) || (i < count - 1 && end % SCRATCH_PAGE_SIZE) || (start & 3)) {
+            return HAL_DISK_ENOIMPL;
+        }
+        for (uintptr_t page = start & ~(SCRATCH_PAGE_SIZE - 1); page < end; page += SCRATCH_PAGE_SIZE) {
+            if (!entries) {
+                cmd->prp1 = start;
+            } else if (entries == 1) {
+                cmd->prp2 = page;
+            }
+            if (entries && list && entries <= NVME_PRP_LIST_ENTRIES) {
+                list[entries - 1] = page;
+            }
+            entries++;
+        }
+        len += segments[i].len;
+    }
+    if (entries > (list ? NVME_PRP_LIST_ENTRIES + 1 : 2) || len / 512 > 0x10000 || (queue->max_transfer && len > queue->max_transfer)) {
+        return HAL_DISK_ENOIMPL;
+    }
+    // With two pages PRP2 points to the second one, with more to the list of all but the first
+    if (entries > 2) {
+        cmd->prp2 = (uint64_t) (uintptr_t) list;
+    }
+    cmd->opcode = write ? 0x01 : 0x02;
+    cmd->namespace_id = this->specific.nvme.namespace_id;
+    cmd->cmd_specific[0] = (uint32_t) lba;
+    cmd->cmd_specific[1] = (uint32_t) (lba >> 32);
+    cmd->cmd_specific[2] = (uint16_t) (len / 512 - 1);
+    return HAL_DISK_ESUCCESS;
+}
+
+static int hal_rw_sg(struct disk_abstract *this, const struct disk_segment *segments, int count, uint64_t lba, int write) {
+    struct nvme_submission_entry cmd = {0};
+    int ret = rw_command(this, segments, count, lba, write, &cmd, this->specific.nvme.queue->prp_lists[0]);
+    if (ret != HAL_DISK_ESUCCESS) {
+        return ret;
     }
-    *c_head_doorbell = *head_ptr;
-    return 0;
+    return nvme_command(this->specific.nvme.cfg, &cmd, this->specific.nvme.queue) != 0 ? HAL_DISK_EUNK : HAL_DISK_ESUCCESS;
 }
 
+// Buffers only have to be dword aligned. Each command takes as much as MDTS and a PRP list allow
 static int hal_rw(struct disk_abstract *this, void *buf, uint64_t lba, int len, int write) {
+    struct nvme_queue *queue = this->specific.nvme.queue;
+    uint8_t *at = buf;
+    while (len) {
+        uint32_t limit = (NVME_PRP_LIST_ENTRIES + 1) * SCRATCH_PAGE_SIZE - (uintptr_t) at % SCRATCH_PAGE_SIZE;
+        if (queue->max_transfer && queue->max_transfer < limit) {
+            limit = queue->max_transfer;
+        }
+        struct disk_segment segment = {at, (uint32_t) len < limit ? (uint32_t) len : (limit & ~511)};
+        int ret = hal_rw_sg(this, &segment, 1, lba, write);
+        if (ret != HAL_DISK_ESUCCESS) {
+            return ret;
+        }
+        at += segment.len;
+        lba += segment.len / 512;
+        len -= segment.len;
+    }
+    return HAL_DISK_ESUCCESS;
+}
+
+// The command ID is the index of the request in the queue. One entry of the queue is always left
+// for nvme_command(), which the HAL falls back to for whatever can't be queued. Requests wanting
+// a PRP list when all of them are taken go that way too
+static int hal_request_submit(struct disk_abstract *this, struct disk_request *request) {
+    struct nvme_queue *queue = this->specific.nvme.queue;
+    int id = 0;
+    while (id < NVME_MAX_REQUESTS && id < queue->entries - 2 && queue->requests[id]) {
+        id++;
+    }
+    if (id == NVME_MAX_REQUESTS || id >= queue->entries - 2) {
+        return HAL_DISK_EBUSY;
+    }
+    // A PRP list from the pool is only kept if the command turns out to need it
     struct nvme_submission_entry cmd = {0};
-    cmd.opcode = write ? 0x01 : 0x02;
-    cmd.namespace_id = this->specific.nvme.namespace_id;
-    cmd.prp1 = (uint64_t) (uintptr_t) buf;
-    cmd.cmd_specific[0] = (uint32_t) lba;
-    cmd.cmd_specific[1] = (uint32_t) (lba >> 32);
-    cmd.cmd_specific[2] = (uint16_t) (len / 512) - 1;
-    return nvme_command(
-        this->specific.nvme.cfg,
-        &cmd,
-        this->specific.nvme.sq,
-        this->specific.nvme.cq,
-        this->specific.nvme.queue_id,
-        &this->specific.nvme.tail,
-        &this->specific.nvme.head,
-        &this->specific.nvme.phase
-    ) != 0 ? HAL_DISK_EUNK : HAL_DISK_ESUCCESS;
+    uint64_t *list = prp_list_get(queue);
+    int ret = rw_command(this, request->segments, request->count, request->lba, request->write, &cmd, list);
+    if (list && (ret != HAL_DISK_ESUCCESS || cmd.prp2 != (uint64_t) (uintptr_t) list)) {
+        prp_list_put(queue, list);
+        list = NULL;
+    }
+    if (ret != HAL_DISK_ESUCCESS) {
+        return ret;
+    }
+    cmd.command_id = id;
+    request->tag = id;
+    request->driver = list;
+    queue->requests[id] = request;
+    submit_entry(this->specific.nvme.cfg, &cmd, queue);
+    return HAL_DISK_ESUCCESS;
+}
+
+static void hal_request_poll(struct disk_abstract *this) {
+    int failed;
+    while (reap(this->specific.nvme.cfg, this->specific.nvme.queue, &failed) != -1);
 }
 
 static int hal_submit(struct disk_abstract *disk, int flp) {
     disk->ops.rw = hal_rw;
+    disk->ops.rw_sg = hal_rw_sg;
+    disk->ops.submit = hal_request_submit;
+    disk->ops.poll = hal_request_poll;
     return hal_disk_submit(disk, flp);
 }
@@ -74,10 +74,31 @@ struct nvme_completion_entry {
     uint16_t status;
 } __attribute__((__packed__));
 
+#define NVME_MAX_REQUESTS 32
+#define NVME_SYNC_ID NVME_MAX_REQUESTS // Command ID of the commands nvme_command() waits for, 0xffff is reserved
+
+struct disk_request;
+
+#define NVME_PRP_LIST_ENTRIES 512 // 4KB pages of 8 byte entries
+#define NVME_PRP_LISTS        4 // The first one is for nvme_command(), the rest for requests in flight
+
+// A submission/completion queue pair and the state needed to drive it.
+// The IO queue pair of a controller is shared by all of its namespaces.
+struct nvme_queue {
+    volatile struct nvme_submission_entry *sq;
+    volatile struct nvme_completion_entry *cq;
+    int id;
+    int entries;
+    uint32_t tail;
+    uint32_t head;
+    int phase;
+    uint64_t *prp_lists[NVME_PRP_LISTS]; // Pages for commands that need more than PRP1 and PRP2
+    uint32_t prp_lists_used;
+    uint32_t max_transfer; // In bytes, from MDTS. 0 when there is no limit
+    struct disk_request *requests[NVME_MAX_REQUESTS]; // In flight, by command ID
+};
+
 void nvme_init();
-int nvme_command(
-    volatile struct nvme_configuration *cfg, struct nvme_submission_entry *command,
-    volatile struct nvme_submission_entry *sq, volatile struct nvme_completion_entry *cq,
-    int id, uint32_t *tail_ptr, uint32_t *head_ptr, int *phase);
+int nvme_command(volatile struct nvme_configuration *cfg, struct nvme_submission_entry *command, struct nvme_queue *queue);
 
 #endif
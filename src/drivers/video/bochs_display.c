@@ -155,6 +155,7 @@ static void vga_compat_controller_init(uint8_t bus, uint8_t slot, uint8_t functi
     display.interface = HAL_DISPLAY_VGA_BGA;
     display.specific.bga.bar2 = bar2;
     display.specific.bga.fb = (void *) (uintptr_t) pci_get_bar(bus, slot, function, 0);
+    display.common.fb_size = pci_get_bar_reachable(bus, slot, function, 0);
     display.geography.interface = HAL_DISPLAY_INTERCONNECT_PCI;
     display.geography.pci.bus = bus;
     display.geography.pci.slot = slot;
@@ -169,6 +170,7 @@ static void non_vga_compat_controller_init(uint8_t bus, uint8_t slot, uint8_t fu
     display.interface = HAL_DISPLAY_BGA;
     display.specific.bga.bar2 = bar2;
     display.specific.bga.fb = (void *) (uintptr_t) pci_get_bar(bus, slot, function, 0);
+    display.common.fb_size = pci_get_bar_reachable(bus, slot, function, 0);
     display.geography.interface = HAL_DISPLAY_INTERCONNECT_PCI;
     display.geography.pci.bus = bus;
     display.geography.pci.slot = slot;
@@ -302,6 +304,9 @@ static int hal_resolution(struct display_abstract *this, int width, int height,
         }
         this->properties.vga_mode = 1;
     } else if (!vga_mode) {
+        if ((size_t) pitch * height > this->common.fb_size) {
+            return HAL_DISPLAY_ENORES;
+        }
         bochs_display_high_res(this->specific.bga.bar2, width, height, bpp, clear);
         this->common.buffer = this->specific.bga.fb;
         this->properties.vga_mode = 0;
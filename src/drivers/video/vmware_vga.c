@@ -63,6 +63,7 @@ static void controller_init(uint8_t bus, uint8_t slot, uint8_t function) {
     vmware_vga.interface = HAL_DISPLAY_VMWARE_VGA;
     void *fb = (void *) (uintptr_t) pci_get_bar(bus, slot, function, 1);
     vmware_vga.common.buffer = fb;
+    vmware_vga.common.fb_size = pci_get_bar_reachable(bus, slot, function, 1);
     vmware_vga.specific.vmware_vga.bar0 = bar0;
     vmware_vga.specific.vmware_vga.fb = fb;
     vmware_vga.specific.vmware_vga.fifo = fifo;
@@ -117,6 +118,9 @@ static int hal_resolution(struct display_abstract *this, int width, int height,
     if (vga_mode || text) {
         return HAL_DISPLAY_ENOIMPL;
     }
+    if ((size_t) width * (bpp / 8) * height > this->common.fb_size) {
+        return HAL_DISPLAY_ENORES;
+    }
     int pitch;
     vmware_vga_high_res(this->specific.vmware_vga.bar0, width, height, bpp, &pitch);
     this->common.buffer = this->specific.vmware_vga.fb;
@@ -1,13 +1,32 @@
 #include <stddef.h>
+#include <cpu/misc.h>
 #include <hal/disk.h>
+#include <tools/alloc.h>
 #include <tools/print.h>
+#include <tools/scratch.h>
 #include <tools/string.h>
 
+#define LINE_SECTORS    (HAL_DISK_CACHE_LINE / 512)
+#define READAHEAD_LINES (HAL_DISK_READAHEAD / HAL_DISK_CACHE_LINE)
+
+struct cache_line {
+    int disk; // -1 when empty
+    int sectors; // Less than a whole line at the end of a disk
+    uint64_t lba;
+    uint32_t used;
+    uint8_t *data;
+};
+
 static struct disk_abstract floppy_inventory[MAX_FLOPPIES] = {0};
 static struct disk_abstract disk_inventory[MAX_DISKS] = {0};
 static int floppy_top = 0x00;
 static int disk_top = 0x80;
 
+static struct cache_line cache[HAL_DISK_CACHE_SETS][HAL_DISK_CACHE_WAYS];
+static uint8_t *readahead_buffer;
+static uint32_t cache_clock;
+static int cache_state; // 1 once set up, -1 when there was no memory for it
+
 static struct disk_abstract *get_disk(int disk) {
     if (disk < 0x80) {
         if (disk >= MAX_FLOPPIES) {
@@ -34,6 +53,148 @@ static const char *disk_type_to_name(int type) {
     }
 }
 
+// Lines are only allocated on the first read, so machines that never boot from a disk don't pay for them
+static int cache_setup() {
+    if (cache_state) {
+        return cache_state;
+    }
+    uint8_t *data = malloc(HAL_DISK_CACHE_SETS * HAL_DISK_CACHE_WAYS * HAL_DISK_CACHE_LINE, HAL_DISK_CACHE_LINE);
+    readahead_buffer = malloc(HAL_DISK_READAHEAD, HAL_DISK_CACHE_LINE);
+    if (!data || !readahead_buffer) {
+        if (data) {
+            free(data, HAL_DISK_CACHE_SETS * HAL_DISK_CACHE_WAYS * HAL_DISK_CACHE_LINE);
+        }
+        if (readahead_buffer) {
+            free(readahead_buffer, HAL_DISK_READAHEAD);
+        }
+        print("HAL: Not enough heap for the disk cache, reads will go straight to the disks");
+        cache_state = -1;
+        return cache_state;
+    }
+    for (int set = 0; set < HAL_DISK_CACHE_SETS; set++) {
+        for (int way = 0; way < HAL_DISK_CACHE_WAYS; way++) {
+            cache[set][way].disk = -1;
+            cache[set][way].data = data + (set * HAL_DISK_CACHE_WAYS + way) * HAL_DISK_CACHE_LINE;
+        }
+    }
+    cache_state = 1;
+    return cache_state;
+}
+
+static struct cache_line *cache_set(int disk, uint64_t lba) {
+    return cache[(lba / LINE_SECTORS + disk) % HAL_DISK_CACHE_SETS];
+}
+
+static struct cache_line *cache_lookup(int disk, uint64_t lba) {
+    struct cache_line *set = cache_set(disk, lba);
+    for (int way = 0; way < HAL_DISK_CACHE_WAYS; way++) {
+        if (set[way].disk == disk && set[way].lba == lba) {
+            return &set[way];
+        }
+    }
+    return NULL;
+}
+
+// An empty line, or the least recently used one of the set
+static struct cache_line *cache_victim(int disk, uint64_t lba) {
+    struct cache_line *set = cache_set(disk, lba);
+    struct cache_line *victim = &set[0];
+    for (int way = 0; way < HAL_DISK_CACHE_WAYS; way++) {
+        if (set[way].disk == -1) {
+            return &set[way];
+        }
+        if (set[way].used < victim->used) {
+            victim = &set[way];
+        }
+    }
+    return victim;
+}
+
+static void cache_invalidate(int disk, uint64_t lba, uint64_t sectors) {
+    for (int set = 0; set < HAL_DISK_CACHE_SETS; set++) {
+        for (int way = 0; way < HAL_DISK_CACHE_WAYS; way++) {
+            struct cache_line *line = &cache[set][way];
+            if (line->disk == disk && line->lba < lba + sectors && lba < line->lba + line->sectors) {
+                line->disk = -1;
+            }
+        }
+    }
+}
+
+// Splits what the driver can't do in a single call
+static int transfer(struct disk_abstract *disk, uint8_t *buf, uint64_t lba, uint64_t sectors, int write) {
+    uint64_t chunk = disk->common.max_transfer ? disk->common.max_transfer / 512 : sectors;
+    while (sectors) {
+        int count = sectors < chunk ? sectors : chunk;
+        int ret = disk->ops.rw(disk, buf, lba, count * 512, write);
+        if (ret != HAL_DISK_ESUCCESS) {
+            return ret;
+        }
+        buf += count * 512;
+        lba += count;
+        sectors -= count;
+    }
+    return HAL_DISK_ESUCCESS;
+}
+
+// Reads the line at lba, and the ones after it too when the disk is being read sequentially.
+// Lines go in backwards, so that the one asked for is the most recently used if they share a set
+static struct cache_line *cache_fill(struct disk_abstract *disk_abstract, int disk, uint64_t lba) {
+    int lines = disk_abstract->cache.sequential >= HAL_DISK_STREAM_THRESHOLD ? READAHEAD_LINES : 1;
+    uint64_t sectors = lines * LINE_SECTORS;
+    if (sectors > disk_abstract->common.lba_max - lba) {
+        sectors = disk_abstract->common.lba_max - lba;
+    }
+    if (transfer(disk_abstract, readahead_buffer, lba, sectors, 0) != HAL_DISK_ESUCCESS) {
+        return NULL;
+    }
+    if (lines > 1) {
+        disk_abstract->cache.readaheads++;
+    }
+    struct cache_line *line = NULL;
+    for (int i = (sectors - 1) / LINE_SECTORS; i >= 0; i--) {
+        uint64_t line_lba = lba + i * LINE_SECTORS;
+        line = cache_lookup(disk, line_lba);
+        if (!line) {
+            line = cache_victim(disk, line_lba);
+            line->disk = disk;
+            line->lba = line_lba;
+            line->sectors = sectors - i * LINE_SECTORS < LINE_SECTORS ? sectors - i * LINE_SECTORS : LINE_SECTORS;
+            memcpy(line->data, readahead_buffer + i * HAL_DISK_CACHE_LINE, line->sectors * 512);
+        }
+        line->used = ++cache_clock;
+    }
+    return line;
+}
+
+static int cache_read(struct disk_abstract *disk_abstract, int disk, uint8_t *buf, uint64_t lba, uint64_t sectors) {
+    disk_abstract->cache.sequential = lba == disk_abstract->cache.next_lba ? disk_abstract->cache.sequential + 1 : 0;
+    disk_abstract->cache.next_lba = lba + sectors;
+    while (sectors) {
+        uint64_t line_lba = lba & ~((uint64_t) LINE_SECTORS - 1);
+        struct cache_line *line = cache_lookup(disk, line_lba);
+        if (line) {
+            disk_abstract->cache.hits++;
+            line->used = ++cache_clock;
+        } else {
+            disk_abstract->cache.misses++;
+            line = cache_fill(disk_abstract, disk, line_lba);
+            if (!line) {
+                return HAL_DISK_EUNK;
+            }
+        }
+        uint64_t count = line->sectors - (lba - line_lba);
+        if (count > sectors) {
+            count = sectors;
+        }
+        memcpy(buf, line->data + (lba - line_lba) * 512, count * 512);
+        buf += count * 512;
+        lba += count;
+        sectors -= count;
+    }
+    return HAL_DISK_ESUCCESS;
+}
+
 int hal_disk_submit(struct disk_abstract *disk, int flp) {
     print("HAL: Submitting a: %s", disk_type_to_name(disk->interface));
     if (flp) {
@@ -56,15 +217,226 @@ int hal_disk_submit(struct disk_abstract *disk, int flp) {
     return HAL_DISK_ESUCCESS;
 }
 
+// Reads as big as the readahead gain nothing from the cache, and go straight to the disk
 int hal_disk_rw(int disk, void *buf, uint64_t lba, int len, int write) {
     struct disk_abstract *disk_abstract = get_disk(disk);
     if (!disk_abstract) {
         return HAL_DISK_ENOFOUND;
     }
-    int (*rw)(struct disk_abstract *this, void *buf, uint64_t lba, int len, int write) =
-        disk_abstract->ops.rw;
-    if (!rw) {
+    if (!disk_abstract->ops.rw) {
+        return HAL_DISK_ENOIMPL;
+    }
+    if (len <= 0 || len % 512) {
+        return HAL_DISK_ESIZE;
+    }
+    uint64_t sectors = len / 512;
+    if (lba >= disk_abstract->common.lba_max || sectors > disk_abstract->common.lba_max - lba) {
+        return HAL_DISK_EBOUNDS;
+    }
+    if (write) {
+        int ret = transfer(disk_abstract, buf, lba, sectors, 1);
+        // Even a failed write may have changed some of the sectors
+        if (cache_state == 1) {
+            cache_invalidate(disk, lba, sectors);
+        }
+        return ret;
+    }
+    if (len >= HAL_DISK_READAHEAD || cache_setup() != 1) {
+        disk_abstract->cache.next_lba = lba + sectors;
+        return transfer(disk_abstract, buf, lba, sectors, 0);
+    }
+    return cache_read(disk_abstract, disk, buf, lba, sectors);
+}
+
+// How many sectors the segments add up to, or an error if they can't be transferred
+static int64_t check_segments(struct disk_abstract *disk_abstract, const struct disk_segment *segments, int count, uint64_t lba) {
+    if (!disk_abstract->ops.rw) {
         return HAL_DISK_ENOIMPL;
     }
-    return rw(disk_abstract, buf, lba, len, write);
+    uint64_t sectors = 0;
+    for (int i = 0; i < count; i++) {
+        if (!segments[i].len || segments[i].len % 512) {
+            return HAL_DISK_ESIZE;
+        }
+        sectors += segments[i].len / 512;
+    }
+    if (!sectors) {
+        return HAL_DISK_ESIZE;
+    }
+    if (lba >= disk_abstract->common.lba_max || sectors > disk_abstract->common.lba_max - lba) {
+        return HAL_DISK_EBOUNDS;
+    }
+    return sectors;
+}
+
+// Consecutive sectors starting at lba go to (or come from) each segment in turn. Drivers with an
+// rw_sg op do it in one command, the rest get one ops.rw call per segment. Reads skip the cache
+int hal_disk_rw_sg(int disk, const struct disk_segment *segments, int count, uint64_t lba, int write) {
+    struct disk_abstract *disk_abstract = get_disk(disk);
+    if (!disk_abstract) {
+        return HAL_DISK_ENOFOUND;
+    }
+    int64_t sectors = check_segments(disk_abstract, segments, count, lba);
+    if (sectors < 0) {
+        return sectors;
+    }
+    int ret = disk_abstract->ops.rw_sg ? disk_abstract->ops.rw_sg(disk_abstract, segments, count, lba, write) : HAL_DISK_ENOIMPL;
+    if (ret == HAL_DISK_ENOIMPL) {
+        uint64_t segment_lba = lba;
+        ret = HAL_DISK_ESUCCESS;
+        for (int i = 0; i < count && ret == HAL_DISK_ESUCCESS; i++) {
+            ret = transfer(disk_abstract, segments[i].buf, segment_lba, segments[i].len / 512, write);
+            segment_lba += segments[i].len / 512;
+        }
+    }
+    if (write && cache_state == 1) {
+        cache_invalidate(disk, lba, sectors);
+    }
+    disk_abstract->cache.next_lba = lba + sectors;
+    return ret;
+}
+
+// Hands pending requests to the driver, in order, until it has no room left
+static void requests_issue(struct disk_abstract *disk_abstract) {
+    while (disk_abstract->requests.pending) {
+        struct disk_request *request = disk_abstract->requests.pending;
+        int ret = disk_abstract->ops.submit(disk_abstract, request);
+        if (ret == HAL_DISK_EBUSY && disk_abstract->requests.inflight) {
+            return;
+        }
+        disk_abstract->requests.pending = request->next;
+        if (ret == HAL_DISK_ESUCCESS) {
+            request->next = disk_abstract->requests.inflight;
+            disk_abstract->requests.inflight = request;
+            disk_abstract->requests.count++;
+        } else if (ret == HAL_DISK_ENOIMPL || ret == HAL_DISK_EBUSY) {
+            // Requests the driver can't queue are done right away, like hal_disk_rw_sg() would
+            request->status = hal_disk_rw_sg(request->disk, request->segments, request->count, request->lba, request->write);
+        } else {
+            request->status = ret;
+        }
+    }
+}
+
+// Reads bypass the sector cache. Writes invalidate it both when they start and when they finish,
+// so that nothing read while they were in flight stays around
+int hal_disk_request_submit(struct disk_request *request) {
+    struct disk_abstract *disk_abstract = get_disk(request->disk);
+    if (!disk_abstract) {
+        return HAL_DISK_ENOFOUND;
+    }
+    int64_t sectors = check_segments(disk_abstract, request->segments, request->count, request->lba);
+    if (sectors < 0) {
+        return sectors;
+    }
+    if (!disk_abstract->ops.submit) {
+        request->status = hal_disk_rw_sg(request->disk, request->segments, request->count, request->lba, request->write);
+        return HAL_DISK_ESUCCESS;
+    }
+    if (request->write && cache_state == 1) {
+        cache_invalidate(request->disk, request->lba, sectors);
+    }
+    request->status = HAL_DISK_EPENDING;
+    request->next = NULL;
+    struct disk_request **tail = &disk_abstract->requests.pending;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = request;
+    requests_issue(disk_abstract);
+    return HAL_DISK_ESUCCESS;
+}
+
+// Finishes whatever the driver completed on the disk of the request, in any order, and returns
+// the status of the request
+int hal_disk_request_poll(struct disk_request *request) {
+    struct disk_abstract *disk_abstract = get_disk(request->disk);
+    if (!disk_abstract || !disk_abstract->requests.inflight) {
+        return request->status;
+    }
+    disk_abstract->ops.poll(disk_abstract);
+    struct disk_request **link = &disk_abstract->requests.inflight;
+    while (*link) {
+        struct disk_request *done = *link;
+        if (done->status == HAL_DISK_EPENDING) {
+            link = &done->next;
+            continue;
+        }
+        *link = done->next;
+        disk_abstract->requests.count--;
+        if (done->write && cache_state == 1) {
+            cache_invalidate(done->disk, done->lba, check_segments(disk_abstract, done->segments, done->count, done->lba));
+        }
+    }
+    requests_issue(disk_abstract);
+    return request->status;
+}
+
+int hal_disk_request_wait(struct disk_request *request) {
+    while (hal_disk_request_poll(request) == HAL_DISK_EPENDING) {
+        pause();
+    }
+    return request->status;
+}
+
+// Only requests the driver hasn't started yet can be taken back. The ones in flight return
+// HAL_DISK_EBUSY, and have to be waited for
+int hal_disk_request_cancel(struct disk_request *request) {
+    struct disk_abstract *disk_abstract = get_disk(request->disk);
+    if (!disk_abstract || request->status != HAL_DISK_EPENDING) {
+        return HAL_DISK_ENOFOUND;
+    }
+    for (struct disk_request **link = &disk_abstract->requests.pending; *link; link = &(*link)->next) {
+        if (*link == request) {
+            *link = request->next;
+            request->status = HAL_DISK_ECANCEL;
+            return HAL_DISK_ESUCCESS;
+        }
+    }
+    return HAL_DISK_EBUSY;
+}
+
+int hal_disk_cache_stats(int disk, uint32_t *hits, uint32_t *misses) {
+    struct disk_abstract *disk_abstract = get_disk(disk);
+    if (!disk_abstract) {
+        return HAL_DISK_ENOFOUND;
+    }
+    *hits = disk_abstract->cache.hits;
+    *misses = disk_abstract->cache.misses;
+    return HAL_DISK_ESUCCESS;
+}
+
+#ifdef BENCH
+#define BENCHMARK_SECTORS 512
+
+// Reads the first 256KB of a disk a sector at a time, like a boot loader going through INT 13h,
+// once straight from the driver and once through the cache
+void hal_disk_benchmark(int disk) {
+    struct disk_abstract *disk_abstract = get_disk(disk);
+    if (!disk_abstract || !disk_abstract->ops.rw || disk_abstract->common.lba_max < BENCHMARK_SECTORS) {
+        return;
+    }
+    void *buf = scratch_get();
+    if (!buf) {
+        return;
+    }
+    uint64_t start = rdtsc();
+    for (int i = 0; i < BENCHMARK_SECTORS; i++) {
+        if (transfer(disk_abstract, buf, i, 1, 0) != HAL_DISK_ESUCCESS) {
+            goto done;
+        }
+    }
+    uint32_t uncached = (rdtsc() - start) / 1000;
+    start = rdtsc();
+    for (int i = 0; i < BENCHMARK_SECTORS; i++) {
+        if (hal_disk_rw(disk, buf, i, 512, 0) != HAL_DISK_ESUCCESS) {
+            goto done;
+        }
+    }
+    uint32_t cached = (rdtsc() - start) / 1000;
+    print("HAL: Reading 256KB a sector at a time from disk %x took %d kcycles uncached, %d kcycles cached (%d hits, %d misses, %d readaheads)",
+        disk, uncached, cached, disk_abstract->cache.hits, disk_abstract->cache.misses, disk_abstract->cache.readaheads);
+done:
+    scratch_put(buf);
 }
+#endif
@@ -4,7 +4,7 @@
 #include <stdint.h>
 
 #define MAX_FLOPPIES 4
-#define MAX_DISKS    16
+#define MAX_DISKS    32
 
 #define HAL_DISK_AHCI 0x01
 #define HAL_DISK_NVME 0x02
@@ -13,6 +13,27 @@
 
 #define HAL_DISK_INTERCONNECT_PCI 0x01
 
+// One destination of a scatter-gather transfer. Every length is a whole number of sectors
+struct disk_segment {
+    void *buf;
+    uint32_t len;
+};
+
+// An asynchronous read or write. Everything but the private fields is filled by the caller,
+// and the request has to stay around until it is no longer HAL_DISK_EPENDING
+struct disk_request {
+    int disk;
+    int write;
+    uint64_t lba;
+    const struct disk_segment *segments;
+    int count;
+    volatile int status;
+    // Private
+    int tag; // Slots or command ID in the driver
+    void *driver;
+    struct disk_request *next;
+};
+
 struct disk_abstract {
     int present;
     int interface;
@@ -20,7 +41,15 @@ struct disk_abstract {
         uint64_t lba_max;
         uint8_t heads_per_cylinder;
         uint8_t sectors_per_head;
+        uint32_t max_transfer; // Biggest read or write a single ops.rw call can do, in bytes
     } common;
+    struct {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t readaheads;
+        uint64_t next_lba; // Where the last read ended
+        int sequential; // How many reads in a row started there
+    } cache;
     union {
         struct {
             volatile struct ahci_abar *abar;
@@ -28,16 +57,12 @@ struct disk_abstract {
             int atapi;
             int drive;
             int lba48;
+            int ncq_depth; // 0 without NCQ
         } ahci;
         struct {
-            volatile struct nvme_configuration *cfg; 
-            volatile struct nvme_submission_entry *sq;
-            volatile struct nvme_completion_entry *cq;
-            int queue_id;
-            uint32_t tail;
-            uint32_t head;
+            volatile struct nvme_configuration *cfg;
+            struct nvme_queue *queue;
             int namespace_id;
-            int phase;
         } nvme;
         struct {
             uint16_t io_base;
@@ -50,7 +75,18 @@ struct disk_abstract {
     } specific;
     struct ops {
         int (*rw)(struct disk_abstract *this, void *buf, uint64_t lba, int len, int write);
+        // Optional. Returns HAL_DISK_ENOIMPL for lists it can't do in one command
+        int (*rw_sg)(struct disk_abstract *this, const struct disk_segment *segments, int count, uint64_t lba, int write);
+        // Optional. submit() starts a request without waiting for it, or returns HAL_DISK_EBUSY when
+        // the device has no room for another one. poll() sets the status of every finished request
+        int (*submit)(struct disk_abstract *this, struct disk_request *request);
+        void (*poll)(struct disk_abstract *this);
     } ops;
+    struct {
+        struct disk_request *pending; // Not handed to the driver yet
+        struct disk_request *inflight;
+        int count;
+    } requests;
     struct {
         int interface;
         union {
@@ -69,8 +105,29 @@ struct disk_abstract {
 #define HAL_DISK_EUNK     -5
 #define HAL_DISK_ENOMORE  -6
 #define HAL_DISK_ENOFOUND -7
+#define HAL_DISK_EPENDING -8
+#define HAL_DISK_EBUSY    -9
+#define HAL_DISK_ECANCEL  -10
+
+// Reads go through a sector cache shared by all disks, of HAL_DISK_CACHE_SETS sets of
+// HAL_DISK_CACHE_WAYS lines. Once a disk is read sequentially, a miss fetches the next
+// HAL_DISK_READAHEAD bytes at once. Writes go straight to the disk and invalidate what they overlap
+#define HAL_DISK_CACHE_LINE       4096
+#define HAL_DISK_CACHE_SETS       4
+#define HAL_DISK_CACHE_WAYS       2
+#define HAL_DISK_READAHEAD        16384
+#define HAL_DISK_STREAM_THRESHOLD 2
 
 int hal_disk_submit(struct disk_abstract *disk, int flp);
 int hal_disk_rw(int disk, void *buf, uint64_t lba, int len, int write);
+int hal_disk_rw_sg(int disk, const struct disk_segment *segments, int count, uint64_t lba, int write);
+int hal_disk_request_submit(struct disk_request *request);
+int hal_disk_request_poll(struct disk_request *request);
+int hal_disk_request_wait(struct disk_request *request);
+int hal_disk_request_cancel(struct disk_request *request);
+int hal_disk_cache_stats(int disk, uint32_t *hits, uint32_t *misses);
+#ifdef BENCH
+void hal_disk_benchmark(int disk);
+#endif
 
 #endif
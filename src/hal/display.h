@@ -1,6 +1,7 @@
 #ifndef __HAL_DISPLAY_H__
 #define __HAL_DISPLAY_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define MAX_DISPLAYS 16
@@ -22,6 +23,7 @@ struct display_abstract {
         int bpp;
         int pitch;
         void *buffer;
+        size_t fb_size; // Whole linear framebuffer
     } common;
     struct {
         int vga_mode;
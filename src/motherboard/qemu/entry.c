@@ -1,8 +1,14 @@
+#include <apis/bios32.h>
+#include <apis/pci_bios.h>
+#include <cpu/idt.h>
+#include <cpu/misc.h>
 #include <cpu/pio.h>
 #include <cpu/smm.h>
 #include <drivers/bus/pci.h>
+#include <drivers/bus/pci_rom.h>
 #include <drivers/clock/rtc.h>
 #include <drivers/hid/ps2.h>
+#include <drivers/irqs/lapic.h>
 #include <drivers/irqs/pic.h>
 #include <motherboard/qemu/rtc_ext.h>
 #include <motherboard/qemu/i440fx/pmc.h>
@@ -11,7 +17,9 @@
 #include <motherboard/qemu/piix3/pci_isa.h>
 #include <motherboard/qemu/piix4/acpi.h>
 #include <motherboard/qemu/piix4/pm.h>
+#include <motherboard/qemu/fw_cfg.h>
 #include <motherboard/qemu/q35/dram.h>
+#include <hal/disk.h>
 #include <hal/power.h>
 #include <tools/alloc.h>
 #include <tools/print.h>
@@ -38,6 +46,38 @@ struct pci_bar_window pci_io_window = {0};
 struct pci_bar_window pci_pref_window = {0};
 struct pci_bar_window pci_pref_window_high = {0};
 
+// Hotplug padding of PCI Express ports, from "buses:io:mem:pref" in opt/org.lakebios/pci-hotplug.
+// Sizes take a K, M or G suffix, and empty fields keep their default:
+// -fw_cfg name=opt/org.lakebios/pci-hotplug,string=4:4K:16M:256M
+static void qemu_pci_hotplug_padding() {
+    struct qemu_fw_cfg_entry entry;
+    char knob[64] = {0};
+    if (qemu_fw_cfg_get_entry("opt/org.lakebios/pci-hotplug", &entry, 0) != 0 || entry.size >= sizeof(knob)) {
+        return;
+    }
+    qemu_fw_cfg_read_raw(&entry, knob, entry.size, 0);
+    uint64_t values[4] = {PCI_HOTPLUG_BUSES, PCI_HOTPLUG_IO, PCI_HOTPLUG_MEM, PCI_HOTPLUG_PREF};
+    const char *c = knob;
+    for (int i = 0; i < 4 && *c; i++) {
+        if (*c >= '0' && *c <= '9') {
+            values[i] = 0;
+            while (*c >= '0' && *c <= '9') {
+                values[i] = (values[i] * 10) + (*c++ - '0');
+            }
+            int shift = *c == 'K' ? 10 : *c == 'M' ? 20 : *c == 'G' ? 30 : 0;
+            values[i] <<= shift;
+            c += shift ? 1 : 0;
+        }
+        if (*c++ != ':') {
+            break;
+        }
+    }
+    struct pci_hotplug_padding padding = {(int) values[0], values[1], values[2], values[3]};
+    pci_hotplug_padding_set(&padding);
+    print("QEMU: PCI hotplug padding of %d buses, %d KB of IO, %d KB of memory and %d KB of prefetchable memory",
+        padding.buses, (int) (padding.io >> 10), (int) (padding.mem >> 10), (int) (padding.pref >> 10));
+}
+
 #ifdef QEMU_I440FX_PIIX
 
 static int qemu_i440fx_piix_reset(struct power_abstract *power_abstract) {
@@ -89,10 +129,14 @@ static void qemu_i440fx_piix_init() {
     qemu_i440fx_pmc_smram_lock();
     // Interrupts
     pic_init(0x08, 0x70);
+    idt_init();
+    lapic_init();
     for (int i = 0; i < 4; i++) {
         qemu_piix3_pci_isa_pirq_route(i, qemu_piix3_pci_isa_pirq_map[i]);
         qemu_piix3_pci_isa_pirq_en(i);
     }
+    // Heap, PCI enumeration uses it for its temporary resource lists
+    alloc_setup((qemu_rtc_ext_conv_mem_kb() * 1024) - HEAP_SIZE);
     // PCI
     // The MMIO windows have two halves for us: the lower one for Memory, and the higher one for Prefetchable
     uint64_t mem32_base = (uint64_t) 0x1000000 + ((uint64_t) qemu_rtc_ext_ext2_mem_kb() * 1024);
@@ -100,9 +144,10 @@ static void qemu_i440fx_piix_init() {
     uint64_t pref32_base = mem32_limit;
     uint64_t pref32_limit = 0xfec00000;
     uint64_t mem64_base = 0x100000000 + ((uint64_t) qemu_rtc_ext_high_mem_kb() * 1024);
-    uint64_t mem64_limit = mem64_base + ((0x1000000000 - mem64_base) / 2);
+    uint64_t high_limit = (uint64_t) 1 << cpu_phys_addr_bits();
+    uint64_t mem64_limit = mem64_base + ((high_limit - mem64_base) / 2);
     uint64_t pref64_base = mem64_limit;
-    uint64_t pref64_limit = 0x1000000000; // 64GB
+    uint64_t pref64_limit = high_limit;
     uint64_t io_base = 0x1000;
     uint64_t io_size = 0xefff;
     pci_mem_window.orig_base = mem32_base;
@@ -125,7 +170,11 @@ static void qemu_i440fx_piix_init() {
     pci_io_window.base = io_base;
     pci_io_window.limit = io_base + io_size;
     pci_io_window.next = NULL;
+    qemu_pci_hotplug_padding();
     pci_setup(&pci_mem_window, &pci_io_window, &pci_pref_window, qemu_i440fx_piix_get_int_line);
+    // BIOS32 directory and PCI BIOS, for protected mode callers
+    pci_bios_init();
+    bios32_init();
     // ACPI
     struct power_abstract power_hal;
     power_hal.interface = HAL_POWER_QEMU_I440FX_PIIX;
@@ -139,11 +188,14 @@ static void qemu_i440fx_piix_init() {
     hal_power_submit(&power_hal);
     // ISA
     ps2_init();
-    // Others
-    alloc_setup((qemu_rtc_ext_conv_mem_kb() * 1024) - HEAP_SIZE);
+    // Option ROMs
+    pci_rom_shadow(qemu_i440fx_pmc_pam_unlock);
     // PCI devices
     ahci_init();
     nvme_init();
+#ifdef BENCH
+    hal_disk_benchmark(0x80);
+#endif
     bochs_display_init();
     vmware_vga_init();
 }
@@ -207,21 +259,27 @@ static void qemu_q35_ich9_init() {
     qemu_q35_dram_smram_lock();
     // Interrupts
     pic_init(0x08, 0x70);
+    idt_init();
+    lapic_init();
     for (int i = 0; i < 8; i++) {
         qemu_ich9_lpc_pirq_route_pic(i);
         qemu_ich9_lpc_pirq_route(i, qemu_ich9_lpc_pirq_map[i]);
     }
+    // Heap, PCI enumeration uses it for its temporary resource lists
+    alloc_setup((qemu_rtc_ext_conv_mem_kb() * 1024) - HEAP_SIZE);
     // PCI
     qemu_q35_dram_pciexbar(QEMU_Q35_PCIEXBAR, QEMU_Q35_DRAM_PCIEXBAR_256MB);
+    pci_ecam_enable(QEMU_Q35_PCIEXBAR, 256);
     // The MMIO windows have two halves for us: the lower one for Memory, and the higher one for Prefetchable
     uint64_t mem32_base = (uint64_t) 0x1000000 + ((uint64_t) qemu_rtc_ext_ext2_mem_kb() * 1024);
     uint64_t mem32_limit = mem32_base + ((QEMU_Q35_PCIEXBAR - mem32_base) / 2);
     uint64_t pref32_base = mem32_limit;
     uint64_t pref32_limit = QEMU_Q35_PCIEXBAR;
     uint64_t mem64_base = 0x100000000 + ((uint64_t) qemu_rtc_ext_high_mem_kb() * 1024);
-    uint64_t mem64_limit = mem64_base + ((0x1000000000 - mem64_base) / 2);
+    uint64_t high_limit = (uint64_t) 1 << cpu_phys_addr_bits();
+    uint64_t mem64_limit = mem64_base + ((high_limit - mem64_base) / 2);
     uint64_t pref64_base = mem64_limit;
-    uint64_t pref64_limit = 0x1000000000; // 64GB
+    uint64_t pref64_limit = high_limit;
     uint64_t io_base = 0x1000;
     uint64_t io_size = 0xefff;
     pci_mem_window.orig_base = mem32_base;
@@ -244,7 +302,11 @@ static void qemu_q35_ich9_init() {
     pci_io_window.base = io_base;
     pci_io_window.limit = io_base + io_size;
     pci_io_window.next = NULL;
+    qemu_pci_hotplug_padding();
     pci_setup(&pci_mem_window, &pci_io_window, &pci_pref_window, qemu_q35_ich9_get_int_line);
+    // BIOS32 directory and PCI BIOS, for protected mode callers
+    pci_bios_init();
+    bios32_init();
     // ISA devices
     ps2_init();
     // ACPI
@@ -259,11 +321,14 @@ static void qemu_q35_ich9_init() {
     power_hal.ops.s4 = qemu_q35_ich9_hal_power_s4;
     power_hal.ops.s5 = qemu_q35_ich9_hal_power_s5;
     hal_power_submit(&power_hal);
-    // Others
-    alloc_setup((qemu_rtc_ext_conv_mem_kb() * 1024) - HEAP_SIZE);
+    // Option ROMs
+    pci_rom_shadow(qemu_q35_dram_pam_unlock);
     // PCI devices
     ahci_init();
     nvme_init();
+#ifdef BENCH
+    hal_disk_benchmark(0x80);
+#endif
     bochs_display_init();
     vmware_vga_init();
 }
@@ -14,7 +14,7 @@ static uint8_t bitmap[HEAP_SIZE / OBJECT_SIZE / 8] = {0};
 static uintptr_t alloc_base;
 
 void alloc_setup(uintptr_t base) {
-    // Reserve 64KB from low memory
+    // Reserve 160KB from low memory
     alloc_base = base;
 }
 
@@ -81,6 +81,30 @@ void *calloc(size_t size, size_t alignment) {
     return ret;
 }
 
+// How many more zones of this size and alignment malloc() could hand out right now
+size_t alloc_count_free(size_t size, size_t alignment) {
+    if (size % 32) {
+        size = (size + OBJECT_SIZE - 1) & ~(OBJECT_SIZE - 1);
+    }
+    size_t pages = size / OBJECT_SIZE;
+    size_t pages_found = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < sizeof(bitmap) * 8; i++) {
+        if (BIT_TEST(i)) {
+            pages_found = 0;
+            continue;
+        }
+        if (pages_found == 0 && (alloc_base + (OBJECT_SIZE * i)) % alignment) {
+            continue;
+        }
+        if (++pages_found == pages) {
+            pages_found = 0;
+            count++;
+        }
+    }
+    return count;
+}
+
 void free(void *base, size_t size) {
     if (!base) {
         print("alloc: SEVERE WARNING: trying to free a NULL pointer!!!");
@@ -3,12 +3,13 @@
 
 #include <stddef.h>
 
-#define HEAP_SIZE (16384 * 4)
+#define HEAP_SIZE (16384 * 10)
 
 void alloc_setup(uintptr_t base);
 void *malloc(size_t size, size_t alignment);
 void *realloc(void *old, size_t oldsize, size_t newsize, size_t alignment);
 void *calloc(size_t size, size_t alignment);
 void free(void *base, size_t size);
+size_t alloc_count_free(size_t size, size_t alignment);
 
 #endif
@@ -48,7 +48,7 @@ void print(const char *msg, ...) {
             }
             if (*msg == 'X') {
                 char number_str[17];
-                int number = va_arg(args, uint64_t);
+                uint64_t number = va_arg(args, uint64_t);
                 memset(&number_str, 0, 17);
                 for (int i = 16; i > 0;) {
                     number_str[--i] = "0123456789abcdef"[number & 0x0f];
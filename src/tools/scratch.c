@@ -0,0 +1,33 @@
+#include <stdint.h>
+#include <tools/print.h>
+#include <tools/scratch.h>
+#include <tools/string.h>
+
+// Page aligned buffers for data that is only needed while a device is being
+// initialized (IDENTIFY data, namespace lists, init-time command queues...).
+// They live in BIOS data instead of the heap, so every controller can borrow
+// them in turn without it costing permanent heap space.
+static uint8_t pool[SCRATCH_PAGES][SCRATCH_PAGE_SIZE] __attribute__((__aligned__(SCRATCH_PAGE_SIZE), __section__(".bss.pages")));
+static int used[SCRATCH_PAGES] = {0};
+
+void *scratch_get() {
+    for (int i = 0; i < SCRATCH_PAGES; i++) {
+        if (!used[i]) {
+            used[i] = 1;
+            memset(pool[i], 0, SCRATCH_PAGE_SIZE);
+            return pool[i];
+        }
+    }
+    print("scratch: all pages are in use");
+    return NULL;
+}
+
+void scratch_put(void *page) {
+    for (int i = 0; i < SCRATCH_PAGES; i++) {
+        if (pool[i] == page) {
+            used[i] = 0;
+            return;
+        }
+    }
+    print("scratch: tried to put back a page that is not from the pool");
+}
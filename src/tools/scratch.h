@@ -0,0 +1,10 @@
+#ifndef __TOOLS_SCRATCH_H__
+#define __TOOLS_SCRATCH_H__
+
+#define SCRATCH_PAGE_SIZE 4096
+#define SCRATCH_PAGES     3
+
+void *scratch_get();
+void scratch_put(void *page);
+
+#endif